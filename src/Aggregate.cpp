@@ -0,0 +1,19 @@
+#include "Aggregate.h"
+#include "KDTree.h"
+#include "BVH.h"
+#include <iostream>
+
+using namespace std;
+
+std::unique_ptr<Aggregate> createAggregate(const std::string &type, TriangleStore tris) {
+    if (type == "bvh") {
+        return make_unique<BVHAccel>(std::move(tris));
+    }
+    if (type == "kdtree_sort") {
+        return make_unique<KdTreeAccel>(std::move(tris), 80, 1, 0.5, 1, -1, KdBuildMode::Sort);
+    }
+    if (type != "kdtree") {
+        cout << "Unknown accelerator: " << type << ", using kdtree" << endl;
+    }
+    return make_unique<KdTreeAccel>(std::move(tris), 80, 1, 0.5, 1, -1, KdBuildMode::Presorted);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "Primitive.h"
+
+// Common interface of the ray tracing acceleration structures
+class Aggregate {
+  public:
+    virtual ~Aggregate() {}
+    virtual Bounds3f WorldBound() const = 0;
+    virtual bool Intersect(const Ray &ray, SurfaceInteraction &isect) const = 0;
+    virtual bool IntersectP(const Ray &ray) const = 0;
+    // Packet traversal, returns a bitmask of the lanes that hit
+    virtual int Intersect(const RayPacket &packet, SurfaceInteraction isect[RayPacket::Size]) const = 0;
+    virtual int IntersectP(const RayPacket &packet) const = 0;
+};
+
+// Build the accelerator named by the [raytracing] accelerator setting ("kdtree", "kdtree_sort" or "bvh")
+std::unique_ptr<Aggregate> createAggregate(const std::string &type, TriangleStore tris);
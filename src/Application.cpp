@@ -10,7 +10,7 @@
 #include <map>
 #include "Shape.h"
 #include "GLSL.h"
-#include "Raytrace.h"
+#include "SceneSnapshot.h"
 #include "Utils.h"
 #include "Door.h"
 
@@ -32,11 +32,21 @@ void Application::run(std::string levelFilename, Controls::InputMode inputMode,
     settings.load(resourceDir + "settings.ini");
     int windowWidth = settings.map->GetInteger("game", "width", 1280);
     int windowHeight = settings.map->GetInteger("game", "height", 720);
-    windowManager.init(windowWidth, windowHeight);
+    // Ray traced videos only simulate and trace, so they need no window or GL
+    // context
+    headless = renderMode == RENDER_RAYTRACE;
+    if (headless) {
+        width = windowWidth;
+        height = windowHeight;
+    } else {
+        windowManager.init(windowWidth, windowHeight);
+    }
     physics.init();
     player.init();
     controls.init(inputMode, recordFilename);
-    glfwGetFramebufferSize(windowManager.getHandle(), &width, &height);
+    if (!headless) {
+        glfwGetFramebufferSize(windowManager.getHandle(), &width, &height);
+    }
     float aspect = (float)SHADOW_WIDTH / (float)SHADOW_HEIGHT;
     LP = glm::perspective(glm::radians(90.0f), aspect, near, far);
 
@@ -47,15 +57,19 @@ void Application::run(std::string levelFilename, Controls::InputMode inputMode,
     }
 
     loadLevel(resourceDir + "levels/" + levelFilename);
-    shaderManager.loadShaders(resourceDir + "shaders");
-    textureManager.loadTextures(resourceDir + "textures");
-    modelManager.loadModels(resourceDir + "models");
+    if (!headless) {
+        shaderManager.loadShaders(resourceDir + "shaders");
+    }
+    textureManager.loadTextures(resourceDir + "textures", !headless);
+    modelManager.loadModels(resourceDir + "models", !headless);
     materialManager.loadMaterials();
 
     orthoProjection = ortho(0.0f, (float)width, 0.0f, float(height));
 
-    initCubemap();
-    initDepthmaps();
+    if (!headless) {
+        initCubemap();
+        initDepthmaps();
+    }
 
     for (Light l : lights) {
         if (l.id == 0) {
@@ -63,28 +77,37 @@ void Application::run(std::string levelFilename, Controls::InputMode inputMode,
         }
     }
 
-    glEnable(GL_DEPTH_TEST);
-    glEnable(GL_CULL_FACE);
-    glEnable(GL_STENCIL_TEST);
+    if (!headless) {
+        glEnable(GL_DEPTH_TEST);
+        glEnable(GL_CULL_FACE);
+        glEnable(GL_STENCIL_TEST);
 
-    glStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
+        glStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
+    }
 
     int frameskip = settings.map->GetInteger("video", "frameskip", 1);
     int renderWidth = settings.map->GetInteger("video", "width", 1280);
     int renderHeight = settings.map->GetInteger("video", "height", 720);
     string renderDir = settings.map->GetString("video", "output_dir", "./render");
+    if (renderMode == RENDER_RAYTRACE) {
+        frameWriter.start(settings.map->GetInteger("video", "encoder_threads", 2),
+                          settings.map->GetInteger("video", "max_queued_frames", 4));
+        frameRenderer.start(settings.map->GetInteger("video", "parallel_frames", 1), renderWidth, renderHeight);
+    }
 
     float dt = 1.0f / 60.0f;
-    while (!glfwWindowShouldClose(windowManager.getHandle())) {
+    while (headless || !glfwWindowShouldClose(windowManager.getHandle())) {
         update(dt);
-        render(dt);
-        glfwSwapBuffers(windowManager.getHandle());
-        glfwPollEvents();
+        if (!headless) {
+            render(dt);
+            glfwSwapBuffers(windowManager.getHandle());
+            glfwPollEvents();
+        }
 
         if (renderMode == RENDER_RAYTRACE && stepCount % frameskip == 0) {
             string numString = to_string(stepCount / frameskip);
             numString = string(5 - numString.length(), '0') + numString;
-            renderRT(renderWidth, renderHeight, renderDir + "/frame" + numString + ".png");
+            frameRenderer.render(SceneSnapshot::capture(), renderDir + "/frame" + numString + ".png");
             if (controls.playbackFinished()) {
                 break;
             }
@@ -92,7 +115,11 @@ void Application::run(std::string levelFilename, Controls::InputMode inputMode,
         stepCount++;
     }
 
-    windowManager.shutdown();
+    frameRenderer.finish();
+    frameWriter.finish();
+    if (!headless) {
+        windowManager.shutdown();
+    }
 }
 
 void Application::updatePortalLights() {
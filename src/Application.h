@@ -19,6 +19,8 @@
 #include "LightSwitch.h"
 #include "MiscItem.h"
 #include "Settings.h"
+#include "FrameWriter.h"
+#include "FrameRenderer.h"
 #include <string>
 #include <vector>
 #include <glm/glm.hpp>
@@ -67,10 +69,14 @@ public:
     Player player;
     Controls controls;
     Settings settings;
+    FrameWriter frameWriter;
+    FrameRenderer frameRenderer;
 
     int width, height;
 
     int stepCount = 0;
+    // No window, GL context or shaders, the game only runs for the ray tracer
+    bool headless = false;
     
     float physicsStep;
     float deltaTime;
@@ -0,0 +1,223 @@
+#include "BVH.h"
+#include <glm/glm.hpp>
+#include <algorithm>
+
+using namespace glm;
+using namespace std;
+
+// BVHAccel Method Definitions
+BVHAccel::BVHAccel(TriangleStore p,
+                   int maxPrimsInNode, int nBuckets)
+    : maxPrimsInNode(std::min(255, maxPrimsInNode)),
+      nBuckets(std::max(2, nBuckets)),
+      tris(std::move(p)) {
+    if (tris.size() == 0) return;
+
+    // Compute bounds for BVH construction
+    std::vector<Bounds3f> primBounds;
+    primBounds.reserve(tris.size());
+    for (int i = 0; i < tris.size(); ++i) {
+        primBounds.push_back(tris.WorldBound(i));
+    }
+
+    // Build BVH directly into its flattened depth-first layout
+    std::vector<int> primNums;
+    buildLinearBVH(primBounds, primNums, this->maxPrimsInNode, this->nBuckets, nodes);
+
+    // Reorder triangles so every leaf refers to a contiguous range
+    tris.reorder(primNums);
+}
+
+BVHAccel::~BVHAccel() {}
+
+Bounds3f BVHAccel::WorldBound() const {
+    return nodes.empty() ? Bounds3f() : nodes[0].bounds;
+}
+
+struct BucketInfo {
+    int count = 0;
+    Bounds3f bounds;
+};
+
+static int recursiveBuild(const std::vector<Bounds3f> &primBounds, std::vector<int> &primNums,
+                          int start, int end, int maxPrimsInNode, int nBuckets,
+                          std::vector<LinearBVHNode> &nodes) {
+    int nodeNum = nodes.size();
+    nodes.emplace_back();
+
+    // Compute bounds of all primitives in BVH node
+    Bounds3f bounds;
+    for (int i = start; i < end; ++i) bounds.extend(primBounds[primNums[i]]);
+    nodes[nodeNum].bounds = bounds;
+
+    int nPrimitives = end - start;
+    if (nPrimitives == 1) {
+        // Create leaf _LinearBVHNode_
+        nodes[nodeNum].primitivesOffset = start;
+        nodes[nodeNum].nPrimitives = nPrimitives;
+        return nodeNum;
+    }
+
+    // Compute bound of primitive centroids, choose split dimension _dim_
+    Bounds3f centroidBounds;
+    for (int i = start; i < end; ++i)
+        centroidBounds.extend(primBounds[primNums[i]].Centroid());
+    int dim = centroidBounds.MaximumExtent();
+
+    // Partition primitives into two sets and build children
+    int mid = (start + end) / 2;
+    if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) {
+        if (nPrimitives <= maxPrimsInNode) {
+            nodes[nodeNum].primitivesOffset = start;
+            nodes[nodeNum].nPrimitives = nPrimitives;
+            return nodeNum;
+        }
+        // All centroids coincide, split the range in half
+    } else if (nPrimitives <= 2) {
+        // Partition primitives into equally sized subsets
+        std::nth_element(&primNums[start], &primNums[mid], &primNums[end - 1] + 1,
+                         [&](int a, int b) {
+                             return primBounds[a].Centroid()[dim] < primBounds[b].Centroid()[dim];
+                         });
+    } else {
+        // Partition primitives using approximate SAH
+        std::vector<BucketInfo> buckets(nBuckets);
+
+        // Initialize _BucketInfo_ for SAH partition buckets
+        for (int i = start; i < end; ++i) {
+            const Bounds3f &b = primBounds[primNums[i]];
+            int bucket = nBuckets * centroidBounds.Offset(b.Centroid())[dim];
+            if (bucket == nBuckets) bucket = nBuckets - 1;
+            buckets[bucket].count++;
+            buckets[bucket].bounds.extend(b);
+        }
+
+        // Compute costs for splitting after each bucket
+        float invSA = 1 / bounds.SurfaceArea();
+        float minCost = INFINITY;
+        int minCostSplitBucket = -1;
+        for (int i = 0; i < nBuckets - 1; ++i) {
+            Bounds3f b0, b1;
+            int count0 = 0, count1 = 0;
+            for (int j = 0; j <= i; ++j) {
+                b0.extend(buckets[j].bounds);
+                count0 += buckets[j].count;
+            }
+            for (int j = i + 1; j < nBuckets; ++j) {
+                b1.extend(buckets[j].bounds);
+                count1 += buckets[j].count;
+            }
+            if (count0 == 0 || count1 == 0) continue;
+            float cost = 0.125f + (count0 * b0.SurfaceArea() + count1 * b1.SurfaceArea()) * invSA;
+            if (cost < minCost) {
+                minCost = cost;
+                minCostSplitBucket = i;
+            }
+        }
+
+        // Either create leaf or split primitives at selected SAH bucket
+        float leafCost = nPrimitives;
+        if (minCostSplitBucket == -1 ||
+            (nPrimitives <= maxPrimsInNode && minCost >= leafCost)) {
+            nodes[nodeNum].primitivesOffset = start;
+            nodes[nodeNum].nPrimitives = nPrimitives;
+            return nodeNum;
+        }
+        int *pmid = std::partition(&primNums[start], &primNums[end - 1] + 1,
+                                   [&](int pn) {
+                                       int b = nBuckets * centroidBounds.Offset(primBounds[pn].Centroid())[dim];
+                                       if (b == nBuckets) b = nBuckets - 1;
+                                       return b <= minCostSplitBucket;
+                                   });
+        mid = pmid - &primNums[0];
+    }
+
+    // Children follow their parent in depth-first order, so only the
+    // second child offset needs to be stored
+    recursiveBuild(primBounds, primNums, start, mid, maxPrimsInNode, nBuckets, nodes);
+    int secondChild = recursiveBuild(primBounds, primNums, mid, end, maxPrimsInNode, nBuckets, nodes);
+    nodes[nodeNum].secondChildOffset = secondChild;
+    nodes[nodeNum].nPrimitives = 0;
+    nodes[nodeNum].axis = dim;
+    return nodeNum;
+}
+
+void buildLinearBVH(const std::vector<Bounds3f> &primBounds, std::vector<int> &primNums,
+                    int maxPrimsInNode, int nBuckets, std::vector<LinearBVHNode> &nodes) {
+    nodes.clear();
+    primNums.resize(primBounds.size());
+    for (size_t i = 0; i < primBounds.size(); ++i) primNums[i] = i;
+    if (primBounds.empty()) return;
+    nodes.reserve(2 * primBounds.size());
+    recursiveBuild(primBounds, primNums, 0, primBounds.size(), maxPrimsInNode, nBuckets, nodes);
+}
+
+bool BVHAccel::Intersect(const Ray &ray, SurfaceInteraction &isect) const {
+    bool hit = false;
+    float tMax = ray.tMax;
+    traverseBVH(nodes, ray, tMax, [&](int offset, int count) {
+        // Intersect ray with primitives in leaf BVH node
+        for (int i = 0; i < count; ++i) {
+            SurfaceInteraction newIsect;
+            if (tris.Intersect(offset + i, ray, newIsect) && newIsect.d <= tMax) {
+                if (!hit || newIsect < isect) {
+                    isect = newIsect;
+                    hit = true;
+                    tMax = std::min(ray.tMax, isect.d + TIE_EPSILON);
+                }
+            }
+        }
+        return false;
+    });
+    return hit;
+}
+
+bool BVHAccel::IntersectP(const Ray &ray) const {
+    bool hit = false;
+    traverseBVH(nodes, ray, ray.tMax, [&](int offset, int count) {
+        for (int i = 0; i < count && !hit; ++i) {
+            hit = tris.IntersectP(offset + i, ray);
+        }
+        return hit;
+    });
+    return hit;
+}
+
+int BVHAccel::Intersect(const RayPacket &packet, SurfaceInteraction isect[RayPacket::Size]) const {
+    int hit = 0;
+    float rayTMax[RayPacket::Size], laneTMax[RayPacket::Size];
+    packet.tMax.store(rayTMax);
+    packet.tMax.store(laneTMax);
+    traverseBVH(nodes, packet, [&]() { return float4::load(laneTMax); }, [&](int offset, int count, int active) {
+        // Intersect the active lanes with primitives in leaf BVH node
+        for (int i = 0; i < count; ++i) {
+            SurfaceInteraction newIsect[RayPacket::Size];
+            int hits = tris.Intersect(offset + i, packet, active, newIsect);
+            for (int lane = 0; lane < RayPacket::Size; lane++) {
+                if (!(hits & (1 << lane)) || newIsect[lane].d > laneTMax[lane]) {
+                    continue;
+                }
+                if (!(hit & (1 << lane)) || newIsect[lane] < isect[lane]) {
+                    isect[lane] = newIsect[lane];
+                    hit |= 1 << lane;
+                    laneTMax[lane] = std::min(rayTMax[lane], isect[lane].d + TIE_EPSILON);
+                }
+            }
+        }
+        return 0;
+    });
+    return hit;
+}
+
+int BVHAccel::IntersectP(const RayPacket &packet) const {
+    int occluded = 0;
+    traverseBVH(nodes, packet, [&]() { return packet.tMax; }, [&](int offset, int count, int active) {
+        for (int i = 0; i < count && active; ++i) {
+            int hits = tris.IntersectP(offset + i, packet, active);
+            occluded |= hits;
+            active &= ~hits;
+        }
+        return occluded;
+    });
+    return occluded;
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <glm/glm.hpp>
+#include "Aggregate.h"
+
+// http://www.pbr-book.org/3ed-2018/Primitives_and_Intersection_Acceleration/Bounding_Volume_Hierarchies.html
+
+struct LinearBVHNode;
+
+// Build a flattened BVH over primBounds with binned SAH. primNums is
+// reordered so that every leaf covers a contiguous range of it.
+void buildLinearBVH(const std::vector<Bounds3f> &primBounds, std::vector<int> &primNums,
+                    int maxPrimsInNode, int nBuckets, std::vector<LinearBVHNode> &nodes);
+
+class BVHAccel : public Aggregate {
+  public:
+    // BVHAccel Public Methods
+    BVHAccel(TriangleStore p,
+             int maxPrimsInNode = 4, int nBuckets = 12);
+    Bounds3f WorldBound() const;
+    ~BVHAccel();
+    bool Intersect(const Ray &ray, SurfaceInteraction &isect) const;
+    bool IntersectP(const Ray &ray) const;
+    // Packet traversal, returns a bitmask of the lanes that hit
+    int Intersect(const RayPacket &packet, SurfaceInteraction isect[RayPacket::Size]) const;
+    int IntersectP(const RayPacket &packet) const;
+
+  private:
+    // BVHAccel Private Data
+    const int maxPrimsInNode, nBuckets;
+    TriangleStore tris;
+    std::vector<LinearBVHNode> nodes;
+};
+
+struct LinearBVHNode {
+    Bounds3f bounds;
+    union {
+        int primitivesOffset;   // leaf
+        int secondChildOffset;  // interior
+    };
+    uint16_t nPrimitives;  // 0 -> interior node
+    uint8_t axis;          // interior node: xyz
+};
+
+// Node walks shared by the BVHs over triangles and over mesh instances,
+// which only differ in what a leaf holds.
+
+// Visit the leaves ray reaches, nearest first. tMax is read before every
+// node test, so leaf can shorten it as it finds hits.
+// leaf(primitivesOffset, nPrimitives) returns true to end the walk.
+template <typename Leaf>
+void traverseBVH(const std::vector<LinearBVHNode> &nodes, const Ray &ray, const float &tMax, Leaf leaf) {
+    if (nodes.empty()) return;
+    glm::vec3 invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+    int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+
+    // Follow ray through BVH nodes to find primitive intersections
+    int toVisitOffset = 0, currentNodeIndex = 0;
+    int nodesToVisit[64];
+    while (true) {
+        const LinearBVHNode *node = &nodes[currentNodeIndex];
+        // Check ray against BVH node
+        if (node->bounds.IntersectP(ray, tMax, invDir, dirIsNeg)) {
+            if (node->nPrimitives > 0) {
+                if (leaf(node->primitivesOffset, (int) node->nPrimitives)) return;
+                if (toVisitOffset == 0) break;
+                currentNodeIndex = nodesToVisit[--toVisitOffset];
+            } else {
+                // Put far BVH node on _nodesToVisit_ stack, advance to near node
+                if (dirIsNeg[node->axis]) {
+                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                    currentNodeIndex = node->secondChildOffset;
+                } else {
+                    nodesToVisit[toVisitOffset++] = node->secondChildOffset;
+                    currentNodeIndex = currentNodeIndex + 1;
+                }
+            }
+        } else {
+            if (toVisitOffset == 0) break;
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
+    }
+}
+
+struct BVHPacketToDo {
+    int node;
+    int active;
+};
+
+// Children are visited in the order preferred by the first active lane
+inline int firstActiveLane(int mask) {
+    int lane = 0;
+    while (!(mask & (1 << lane))) lane++;
+    return lane;
+}
+
+// Visit the leaves reached by any active lane of packet. tMax() gives the
+// lane distances to test nodes against.
+// leaf(primitivesOffset, nPrimitives, active) returns the lanes that are
+// done, which skip the rest of the walk; it ends once every lane is done.
+template <typename TMax, typename Leaf>
+void traverseBVH(const std::vector<LinearBVHNode> &nodes, const RayPacket &packet, TMax tMax, Leaf leaf) {
+    if (nodes.empty() || !packet.active) return;
+    int lane0 = firstActiveLane(packet.active);
+    int dirIsNeg[3] = {packet.invDir[0][lane0] < 0, packet.invDir[1][lane0] < 0,
+                       packet.invDir[2][lane0] < 0};
+
+    BVHPacketToDo nodesToVisit[64];
+    int toVisitOffset = 0, currentNodeIndex = 0, active = packet.active;
+    int done = 0;
+    while (true) {
+        const LinearBVHNode *node = &nodes[currentNodeIndex];
+        int nodeActive = node->bounds.IntersectP(packet, tMax(), active & ~done, nullptr, nullptr);
+        if (nodeActive && node->nPrimitives > 0) {
+            done |= leaf(node->primitivesOffset, (int) node->nPrimitives, nodeActive);
+            if (done == packet.active) return;
+        } else if (nodeActive) {
+            // Put far BVH node on _nodesToVisit_ stack, advance to near node
+            int near = currentNodeIndex + 1, far = node->secondChildOffset;
+            if (dirIsNeg[node->axis]) std::swap(near, far);
+            nodesToVisit[toVisitOffset].node = far;
+            nodesToVisit[toVisitOffset].active = nodeActive;
+            ++toVisitOffset;
+            currentNodeIndex = near;
+            active = nodeActive;
+            continue;
+        }
+        if (toVisitOffset == 0) break;
+        --toVisitOffset;
+        currentNodeIndex = nodesToVisit[toVisitOffset].node;
+        active = nodesToVisit[toVisitOffset].active;
+    }
+}
@@ -2,6 +2,7 @@
 
 #include "Application.h"
 #include "Raytrace.h"
+#include "SceneSnapshot.h"
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -13,9 +14,15 @@
 using namespace std;
 
 void Controls::init(InputMode mode, string recordingFile) {
-    glfwGetCursorPos(app.windowManager.getHandle(), &prevXpos, &prevYpos);
     this->mode = mode;
     this->recordingFile = recordingFile;
+    if (app.headless) {
+        // Without a window input can only come from a recording
+        prevXpos = prevYpos = 0;
+        loadRecording(recordingFile);
+        return;
+    }
+    glfwGetCursorPos(app.windowManager.getHandle(), &prevXpos, &prevYpos);
     if (mode == PLAYBACK) {
         loadRecording(recordingFile);
         glfwSetInputMode(app.windowManager.getHandle(), GLFW_CURSOR, GLFW_CURSOR_NORMAL);
@@ -123,6 +130,9 @@ void Controls::update() {
         }
     }
 
+    if (app.headless) {
+        return;
+    }
     if (glfwGetKey(handle, GLFW_KEY_ESCAPE) == GLFW_PRESS) {
         if (mode == RECORD) {
             saveRecording(recordingFile);
@@ -135,7 +145,15 @@ void Controls::update() {
         int height = app.settings.map->GetInteger("screenshot", "height", 720);
         string outputDir = app.settings.map->GetString("screenshot", "output_dir", ".");
         float t = glfwGetTime();
-        renderRT(width, height, outputDir + "/screenshot" + to_string(std::time(0)) + ".png");
+        // Kept so the walls are only built for the first screenshot
+        static SceneAccel screenshotAccel;
+        static RenderCaches screenshotCaches;
+        loadRTSettings();
+        renderRT(screenshotAccel, screenshotCaches, SceneSnapshot::capture(), width, height,
+                 outputDir + "/screenshot" + to_string(std::time(0)) + ".png",
+                 [](int done, int total) {
+                     cout << "\rRendering: " << 100 * done / total << "%" << (done == total ? "\n" : "") << flush;
+                 });
         cout << "Render time: " << glfwGetTime() - t << endl;
     }
     if (glfwGetKey(handle, GLFW_KEY_P) == GLFW_PRESS) {
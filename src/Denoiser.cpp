@@ -0,0 +1,90 @@
+#include "Denoiser.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace glm;
+using namespace std;
+
+// Keeps black texels from dividing the lighting by zero
+static const float albedoEpsilon = 0.01f;
+
+FeatureBuffers::FeatureBuffers(int width, int height) :
+    width(width), height(height), albedo(width * height, vec3(1)), normal(width * height, vec3(0)),
+    depth(width * height, INFINITY)
+{
+
+}
+
+void FeatureBuffers::set(int pixelIdx, const glm::vec3 &albedo, const glm::vec3 &normal, float depth) {
+    this->albedo[pixelIdx] = albedo;
+    this->normal[pixelIdx] = normal;
+    this->depth[pixelIdx] = depth;
+}
+
+void denoise(std::vector<glm::vec3> &color, const FeatureBuffers &features, const DenoiseSettings &settings) {
+    int width = features.width, height = features.height;
+    vector<vec3> current(color.size()), next(color.size());
+    for (size_t i = 0; i < color.size(); i++) {
+        current[i] = color[i] / (features.albedo[i] + albedoEpsilon);
+    }
+
+    // B3 spline, separable 5 tap kernel
+    static const float kernel[5] = { 1 / 16.f, 1 / 4.f, 3 / 8.f, 1 / 4.f, 1 / 16.f };
+    for (int iteration = 0; iteration < settings.iterations; iteration++) {
+        int step = 1 << iteration;
+        float colorSigma = settings.colorSigma * 255 / step;
+        float invColorVar = 1 / std::max(1e-6f, colorSigma * colorSigma);
+
+        #pragma omp parallel for schedule(dynamic)
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                int p = y * width + x;
+                vec3 cp = current[p];
+                vec3 np = features.normal[p];
+                float zp = features.depth[p];
+
+                vec3 sum(0);
+                float weightSum = 0;
+                for (int j = -2; j <= 2; j++) {
+                    int qy = y + j * step;
+                    if (qy < 0 || qy >= height) {
+                        continue;
+                    }
+                    for (int i = -2; i <= 2; i++) {
+                        int qx = x + i * step;
+                        if (qx < 0 || qx >= width) {
+                            continue;
+                        }
+                        int q = qy * width + qx;
+                        float zq = features.depth[q];
+
+                        // Pixels that missed only mix with each other
+                        float weight = kernel[i + 2] * kernel[j + 2];
+                        if (std::isinf(zp) || std::isinf(zq)) {
+                            if (std::isinf(zp) != std::isinf(zq)) {
+                                continue;
+                            }
+                        }
+                        else {
+                            float pixelDistance = step * std::max(abs(i), abs(j));
+                            weight *= exp(-abs(zp - zq) / (settings.depthSigma * zp * std::max(1.f, pixelDistance) + 1e-6f));
+                            weight *= pow(std::max(0.f, dot(np, features.normal[q])), settings.normalPower);
+                        }
+                        vec3 diff = current[q] - cp;
+                        weight *= exp(-dot(diff, diff) * invColorVar);
+
+                        sum += current[q] * weight;
+                        weightSum += weight;
+                    }
+                }
+                // The center pixel always has a weight, so weightSum > 0
+                next[p] = sum / weightSum;
+            }
+        }
+        current.swap(next);
+    }
+
+    for (size_t i = 0; i < color.size(); i++) {
+        color[i] = current[i] * (features.albedo[i] + albedoEpsilon);
+    }
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <vector>
+#include <glm/glm.hpp>
+
+// Per pixel features of the first surface the camera sees, through any
+// portals in the way. They are nearly noise free, so they tell the denoiser
+// where the edges in the image are.
+struct FeatureBuffers {
+    FeatureBuffers(int width, int height);
+    // Set a pixel that hit something, albedo is in 0-1
+    void set(int pixelIdx, const glm::vec3 &albedo, const glm::vec3 &normal, float depth);
+    int width, height;
+    std::vector<glm::vec3> albedo, normal;
+    // Distance to the surface, infinite where nothing was hit
+    std::vector<float> depth;
+};
+
+struct DenoiseSettings {
+    // Each pass doubles the filter's reach, 5 passes cover 61x61 pixels
+    int iterations = 4;
+    // Allowed color difference relative to 255, halved every pass
+    float colorSigma = 0.5f;
+    // Exponent on the cosine between two normals
+    float normalPower = 64;
+    // Allowed depth difference relative to the depth per pixel of distance
+    float depthSigma = 0.05f;
+};
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al., "Edge-Avoiding
+// A-Trous Wavelet Transform for fast Global Illumination Filtering", 2010).
+// color is divided by the albedo before filtering and multiplied back
+// afterwards, so the textures stay sharp and only the lighting is blurred.
+void denoise(std::vector<glm::vec3> &color, const FeatureBuffers &features, const DenoiseSettings &settings);
@@ -0,0 +1,95 @@
+#include "FrameRenderer.h"
+#include "Application.h"
+#include "Raytrace.h"
+#include "SceneSnapshot.h"
+#include <algorithm>
+#include <iostream>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using namespace std;
+
+FrameRenderer::~FrameRenderer() {
+    finish();
+}
+
+void FrameRenderer::start(int numFrames, int width, int height) {
+    finish();
+    loadRTSettings();
+    this->width = width;
+    this->height = height;
+    stopping = false;
+    // The temporal cache and the light resampler need the frames in order,
+    // and a frame thread's irradiance cache would be wiped by every frame
+    // whose portals differ from the last one it traced
+    if (numFrames > 1 && (app.settings.map->GetBoolean("raytracing", "temporal", false) ||
+                          app.settings.map->GetBoolean("raytracing", "restir", false) ||
+                          app.settings.map->GetBoolean("raytracing", "irradiance_cache", false))) {
+        cout << "frames share cached light, tracing one frame at a time" << endl;
+        numFrames = 1;
+    }
+    if (numFrames <= 1) {
+        return;
+    }
+
+#ifdef _OPENMP
+    int threadsPerFrame = std::max(1, omp_get_max_threads() / numFrames);
+#else
+    int threadsPerFrame = 1;
+#endif
+    for (int i = 0; i < numFrames; i++) {
+        threads.emplace_back(&FrameRenderer::renderLoop, this, threadsPerFrame);
+    }
+}
+
+void FrameRenderer::render(std::shared_ptr<SceneSnapshot> scene, const std::string &filename) {
+    if (threads.empty()) {
+        renderRT(sceneAccel, caches, std::move(scene), width, height, filename);
+        return;
+    }
+    // One waiting frame per thread, so the simulation stays at most two
+    // frames per thread ahead
+    unique_lock<std::mutex> lock(mutex);
+    dequeued.wait(lock, [&] { return jobs.size() < threads.size(); });
+    jobs.push_back({ std::move(scene), filename });
+    queued.notify_one();
+}
+
+void FrameRenderer::finish() {
+    {
+        lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    queued.notify_all();
+    // The threads drain the queue before they exit
+    for (thread &t : threads) {
+        t.join();
+    }
+    threads.clear();
+}
+
+void FrameRenderer::renderLoop(int threadsPerFrame) {
+#ifdef _OPENMP
+    // Applies to the parallel regions this thread starts
+    omp_set_num_threads(threadsPerFrame);
+#endif
+    // Every frame thread keeps its own trees and caches across the frames it
+    // traces
+    SceneAccel accel;
+    RenderCaches caches;
+    while (true) {
+        Job job;
+        {
+            unique_lock<std::mutex> lock(mutex);
+            queued.wait(lock, [&] { return !jobs.empty() || stopping; });
+            if (jobs.empty()) {
+                return;
+            }
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        dequeued.notify_one();
+        renderRT(accel, caches, std::move(job.scene), width, height, job.filename);
+    }
+}
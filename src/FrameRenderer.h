@@ -0,0 +1,46 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Raytrace.h"
+#include "SceneAccel.h"
+
+struct SceneSnapshot;
+
+// Traces video frames from scene snapshots. With more than one frame in
+// flight the game simulates ahead while a pool of threads traces several
+// snapshots at once, each with its own accelerator and an even share of the
+// OpenMP threads for its pixels.
+class FrameRenderer {
+  public:
+    ~FrameRenderer();
+    // Read the ray tracing settings and start numFrames frame threads. With a
+    // single frame, render traces on the calling thread.
+    void start(int numFrames, int width, int height);
+    // Trace scene into filename, blocks while every frame thread is busy
+    void render(std::shared_ptr<SceneSnapshot> scene, const std::string &filename);
+    // Wait for every submitted frame to be traced and stop the threads
+    void finish();
+
+  private:
+    struct Job {
+        std::shared_ptr<SceneSnapshot> scene;
+        std::string filename;
+    };
+    void renderLoop(int threadsPerFrame);
+
+    int width = 0, height = 0;
+    // Used when frames are traced one at a time
+    SceneAccel sceneAccel;
+    RenderCaches caches;
+    std::mutex mutex;
+    std::condition_variable queued, dequeued;
+    std::deque<Job> jobs;
+    std::vector<std::thread> threads;
+    bool stopping = false;
+};
@@ -0,0 +1,68 @@
+#include "FrameWriter.h"
+#include <algorithm>
+#include <iostream>
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb_image_write.h>
+
+using namespace std;
+
+FrameWriter::~FrameWriter() {
+    finish();
+}
+
+void FrameWriter::start(int numThreads, int maxQueued) {
+    finish();
+    stopping = false;
+    this->maxQueued = std::max(1, maxQueued);
+    for (int i = 0; i < numThreads; i++) {
+        threads.emplace_back(&FrameWriter::encodeLoop, this);
+    }
+}
+
+void FrameWriter::write(const std::string &filename, int width, int height, std::vector<unsigned char> pixels) {
+    Frame frame = { filename, width, height, std::move(pixels) };
+    if (threads.empty()) {
+        encode(frame);
+        return;
+    }
+    unique_lock<std::mutex> lock(mutex);
+    dequeued.wait(lock, [&] { return frames.size() < maxQueued; });
+    frames.push_back(std::move(frame));
+    queued.notify_one();
+}
+
+void FrameWriter::finish() {
+    {
+        lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    queued.notify_all();
+    // The threads drain the queue before they exit
+    for (thread &t : threads) {
+        t.join();
+    }
+    threads.clear();
+}
+
+void FrameWriter::encode(const Frame &frame) {
+    if (!stbi_write_png(frame.filename.c_str(), frame.width, frame.height, 3, frame.pixels.data(), frame.width * 3)) {
+        cerr << "Could not write " << frame.filename << endl;
+    }
+}
+
+void FrameWriter::encodeLoop() {
+    while (true) {
+        Frame frame;
+        {
+            unique_lock<std::mutex> lock(mutex);
+            queued.wait(lock, [&] { return !frames.empty() || stopping; });
+            if (frames.empty()) {
+                return;
+            }
+            frame = std::move(frames.front());
+            frames.pop_front();
+        }
+        dequeued.notify_one();
+        encode(frame);
+    }
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Encodes finished frames to png on background threads, so the next frame
+// can be simulated and traced while the previous one is compressed. At most
+// maxQueued frames wait to be encoded; write blocks until there is room,
+// which keeps memory bounded when encoding falls behind.
+class FrameWriter {
+  public:
+    ~FrameWriter();
+    // Start the encoder threads. Before this, write encodes right away.
+    void start(int numThreads, int maxQueued);
+    // Queue an RGB8 frame to be written to filename
+    void write(const std::string &filename, int width, int height, std::vector<unsigned char> pixels);
+    // Wait for every queued frame to be written and stop the threads
+    void finish();
+
+  private:
+    struct Frame {
+        std::string filename;
+        int width, height;
+        std::vector<unsigned char> pixels;
+    };
+    static void encode(const Frame &frame);
+    void encodeLoop();
+
+    std::mutex mutex;
+    std::condition_variable queued, dequeued;
+    std::deque<Frame> frames;
+    std::vector<std::thread> threads;
+    size_t maxQueued = 1;
+    bool stopping = false;
+};
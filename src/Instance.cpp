@@ -0,0 +1,140 @@
+#include "Instance.h"
+#include <algorithm>
+
+using namespace glm;
+using namespace std;
+
+Ray MeshInstance::toObject(const Ray &ray, float tMax) const {
+    // Directions are not renormalized, so distances along the ray stay the
+    // same in both spaces
+    return Ray(vec3(worldToObject * vec4(ray.o, 1)), vec3(worldToObject * vec4(ray.d, 0)), tMax);
+}
+
+RayPacket MeshInstance::toObject(const RayPacket &packet, const float4 &tMax, int active) const {
+    RayPacket result = packet;
+    const mat4 &m = worldToObject;
+    for (int i = 0; i < 3; i++) {
+        result.o[i] = float4(m[0][i]) * packet.o[0] + float4(m[1][i]) * packet.o[1] +
+                      float4(m[2][i]) * packet.o[2] + float4(m[3][i]);
+        result.d[i] = float4(m[0][i]) * packet.d[0] + float4(m[1][i]) * packet.d[1] +
+                      float4(m[2][i]) * packet.d[2];
+        result.invDir[i] = float4(1.f) / result.d[i];
+    }
+    result.tMax = tMax;
+    result.active = active;
+    return result;
+}
+
+InstanceAccel::InstanceAccel(std::vector<MeshInstance> inst) : instances(std::move(inst)) {
+    std::vector<Bounds3f> instanceBounds;
+    instanceBounds.reserve(instances.size());
+    for (const MeshInstance &instance : instances) {
+        instanceBounds.push_back(instance.worldBound);
+    }
+
+    std::vector<int> instanceNums;
+    buildLinearBVH(instanceBounds, instanceNums, 2, 12, nodes);
+
+    std::vector<MeshInstance> ordered;
+    ordered.reserve(instances.size());
+    for (int instanceNum : instanceNums) ordered.push_back(std::move(instances[instanceNum]));
+    instances.swap(ordered);
+}
+
+void InstanceAccel::setObjects(const std::vector<ObjectTag> &objects) {
+    for (MeshInstance &instance : instances) {
+        instance.object = objects[instance.placement];
+    }
+}
+
+Bounds3f InstanceAccel::WorldBound() const {
+    return nodes.empty() ? Bounds3f() : nodes[0].bounds;
+}
+
+bool InstanceAccel::Intersect(const Ray &ray, SurfaceInteraction &isect) const {
+    bool hit = false;
+    float tMax = ray.tMax;
+    traverseBVH(nodes, ray, tMax, [&](int offset, int count) {
+        // Intersect ray with the meshes of the instances in the leaf
+        for (int i = 0; i < count; ++i) {
+            const MeshInstance &instance = instances[offset + i];
+            SurfaceInteraction newIsect;
+            if (instance.mesh->Intersect(instance.toObject(ray, tMax), newIsect) && newIsect.d <= tMax) {
+                newIsect.setObject(instance.object);
+                newIsect.objectToWorld = &instance.objectToWorld;
+                newIsect.shading = &instance.shading[newIsect.faceIndex];
+                if (!hit || newIsect < isect) {
+                    isect = newIsect;
+                    hit = true;
+                    tMax = std::min(ray.tMax, isect.d + TIE_EPSILON);
+                }
+            }
+        }
+        return false;
+    });
+    return hit;
+}
+
+bool InstanceAccel::IntersectP(const Ray &ray) const {
+    bool hit = false;
+    traverseBVH(nodes, ray, ray.tMax, [&](int offset, int count) {
+        for (int i = 0; i < count && !hit; ++i) {
+            const MeshInstance &instance = instances[offset + i];
+            hit = instance.mesh->IntersectP(instance.toObject(ray, ray.tMax));
+        }
+        return hit;
+    });
+    return hit;
+}
+
+int InstanceAccel::Intersect(const RayPacket &packet, SurfaceInteraction isect[RayPacket::Size]) const {
+    int hit = 0;
+    float rayTMax[RayPacket::Size], laneTMax[RayPacket::Size];
+    packet.tMax.store(rayTMax);
+    packet.tMax.store(laneTMax);
+    traverseBVH(nodes, packet, [&]() { return float4::load(laneTMax); }, [&](int offset, int count, int active) {
+        // Trace the active lanes through the meshes of the instances in the leaf
+        for (int i = 0; i < count; ++i) {
+            const MeshInstance &instance = instances[offset + i];
+            SurfaceInteraction newIsect[RayPacket::Size];
+            int hits = instance.mesh->Intersect(instance.toObject(packet, float4::load(laneTMax), active), newIsect);
+            for (int lane = 0; lane < RayPacket::Size; lane++) {
+                if (!(hits & (1 << lane)) || newIsect[lane].d > laneTMax[lane]) {
+                    continue;
+                }
+                newIsect[lane].setObject(instance.object);
+                newIsect[lane].objectToWorld = &instance.objectToWorld;
+                newIsect[lane].shading = &instance.shading[newIsect[lane].faceIndex];
+                if (!(hit & (1 << lane)) || newIsect[lane] < isect[lane]) {
+                    isect[lane] = newIsect[lane];
+                    hit |= 1 << lane;
+                    laneTMax[lane] = std::min(rayTMax[lane], isect[lane].d + TIE_EPSILON);
+                }
+            }
+        }
+        return 0;
+    });
+    return hit;
+}
+
+int InstanceAccel::IntersectP(const RayPacket &packet) const {
+    int occluded = 0;
+    traverseBVH(nodes, packet, [&]() { return packet.tMax; }, [&](int offset, int count, int active) {
+        for (int i = 0; i < count && active; ++i) {
+            const MeshInstance &instance = instances[offset + i];
+            int hits = instance.mesh->IntersectP(instance.toObject(packet, packet.tMax, active));
+            occluded |= hits;
+            active &= ~hits;
+        }
+        return occluded;
+    });
+    return occluded;
+}
+
+const Aggregate *MeshCache::get(Shape *shape, const std::string &type) {
+    std::unique_ptr<Aggregate> &mesh = meshes[shape];
+    if (!mesh) {
+        mesh = createAggregate(type, shapeToTriangles(shape));
+    }
+    return mesh.get();
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <glm/glm.hpp>
+#include "Aggregate.h"
+#include "BVH.h"
+
+// A mesh placed in the world. The mesh's aggregate is shared by every object
+// using it and is traversed with the ray moved into object space.
+struct MeshInstance {
+    ObjectTag object;
+    // Index of the object among those the accelerator was built from
+    int placement = 0;
+    const Aggregate *mesh;
+    glm::mat4 objectToWorld, worldToObject;
+    Bounds3f worldBound;
+    // Indexed by the face index of a hit
+    std::vector<ShadingRecord> shading;
+    Ray toObject(const Ray &ray, float tMax) const;
+    RayPacket toObject(const RayPacket &packet, const float4 &tMax, int active) const;
+};
+
+// Top-level BVH over mesh instances
+class InstanceAccel : public Aggregate {
+  public:
+    InstanceAccel(std::vector<MeshInstance> instances);
+    // Swap the objects of the instances for others with the same meshes and
+    // transforms, indexed like the objects the instances were built from
+    void setObjects(const std::vector<ObjectTag> &objects);
+    Bounds3f WorldBound() const;
+    bool Intersect(const Ray &ray, SurfaceInteraction &isect) const;
+    bool IntersectP(const Ray &ray) const;
+    // Packet traversal, returns a bitmask of the lanes that hit
+    int Intersect(const RayPacket &packet, SurfaceInteraction isect[RayPacket::Size]) const;
+    int IntersectP(const RayPacket &packet) const;
+
+  private:
+    std::vector<MeshInstance> instances;
+    std::vector<LinearBVHNode> nodes;
+};
+
+// Object space aggregate of every mesh, built the first time it is used
+class MeshCache {
+  public:
+    const Aggregate *get(Shape *shape, const std::string &type);
+    void clear() { meshes.clear(); }
+
+  private:
+    std::unordered_map<Shape *, std::unique_ptr<Aggregate>> meshes;
+};
@@ -0,0 +1,129 @@
+#include "IrradianceCache.h"
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+
+using namespace glm;
+using namespace std;
+
+void IrradianceCache::update(float maxError, float minRadius, float maxRadius, const std::string &sceneKey) {
+    unique_lock<shared_mutex> lock(mutex);
+    if (maxError == this->maxError && minRadius == this->minRadius && maxRadius == this->maxRadius &&
+        sceneKey == this->sceneKey) {
+        return;
+    }
+    this->maxError = maxError;
+    this->minRadius = minRadius;
+    this->maxRadius = std::max(minRadius, maxRadius);
+    this->sceneKey = sceneKey;
+    records.clear();
+    cells.clear();
+}
+
+glm::ivec3 IrradianceCache::cellOf(const glm::vec3 &p) const {
+    return ivec3(floor(p / maxRadius));
+}
+
+uint64_t IrradianceCache::cellKey(const glm::ivec3 &cell) const {
+    return (uint64_t(cell.x & 0x1fffff) << 42) | (uint64_t(cell.y & 0x1fffff) << 21) | uint64_t(cell.z & 0x1fffff);
+}
+
+bool IrradianceCache::lookup(const glm::vec3 &pos, const glm::vec3 &normal, glm::vec3 &irradiance) const {
+    shared_lock<shared_mutex> lock(mutex);
+    auto cell = cells.find(cellKey(cellOf(pos)));
+    if (cell == cells.end()) {
+        return false;
+    }
+
+    vec3 sum(0);
+    float weightSum = 0;
+    for (int i : cell->second) {
+        const IrradianceRecord &record = records[i];
+        vec3 offset = pos - record.pos;
+
+        // Skip records in front of the point, they may see light it cannot
+        if (dot(offset, normal + record.normal) < -0.01f * record.radius) {
+            continue;
+        }
+
+        // Ward's error estimate, the record is used while it is below maxError
+        float error = length(offset) / record.radius + sqrt(std::max(0.f, 1 - dot(normal, record.normal)));
+        if (error >= maxError) {
+            continue;
+        }
+        float weight = error > 0 ? 1 / error : 1e6f;
+        sum += weight * max(vec3(0), record.irradiance + transpose(record.gradient) * offset);
+        weightSum += weight;
+    }
+    if (weightSum == 0) {
+        return false;
+    }
+    irradiance = sum / weightSum;
+    return true;
+}
+
+IrradianceRecord IrradianceCache::createRecord(const glm::vec3 &pos, const glm::vec3 &normal,
+                                               const std::vector<IrradianceSample> &samples) const {
+    IrradianceRecord record;
+    record.pos = pos;
+    record.normal = normal;
+
+    vec3 mean(0);
+    float invDistanceSum = 0;
+    for (const IrradianceSample &sample : samples) {
+        mean += sample.radiance;
+        invDistanceSum += 1 / sample.distance;
+    }
+    mean /= (float) std::max<size_t>(1, samples.size());
+    record.irradiance = mean;
+
+    // Harmonic mean distance to the surroundings
+    float harmonicMean = invDistanceSum > 0 ? samples.size() / invDistanceSum : maxRadius;
+    record.radius = glm::clamp(harmonicMean, minRadius, maxRadius);
+
+    // Moving towards what a sample sees makes it cover more of the
+    // hemisphere, in proportion to 2 / distance. Weighting by the difference
+    // from the mean keeps uniformly lit surroundings at a zero gradient.
+    record.gradient = mat3(0);
+    for (const IrradianceSample &sample : samples) {
+        if (std::isinf(sample.distance)) {
+            continue;
+        }
+        vec3 tangentDir = sample.dir - normal * dot(normal, sample.dir);
+        vec3 dirGradient = tangentDir * (2 / std::max(sample.distance, minRadius));
+        vec3 diff = sample.radiance - mean;
+        for (int c = 0; c < 3; c++) {
+            record.gradient[c] += diff[c] * dirGradient;
+        }
+    }
+    if (!samples.empty()) {
+        for (int c = 0; c < 3; c++) {
+            record.gradient[c] /= (float) samples.size();
+        }
+    }
+    return record;
+}
+
+void IrradianceCache::add(const IrradianceRecord &record) {
+    unique_lock<shared_mutex> lock(mutex);
+    int index = records.size();
+    records.push_back(record);
+
+    // Every cell lookup can accept the record in, which is within maxError
+    // times its radius
+    float reach = record.radius * std::max(1.f, maxError);
+    ivec3 lo = cellOf(record.pos - vec3(reach));
+    ivec3 hi = cellOf(record.pos + vec3(reach));
+    for (int x = lo.x; x <= hi.x; x++) {
+        for (int y = lo.y; y <= hi.y; y++) {
+            for (int z = lo.z; z <= hi.z; z++) {
+                cells[cellKey(ivec3(x, y, z))].push_back(index);
+            }
+        }
+    }
+}
+
+size_t IrradianceCache::size() const {
+    shared_lock<shared_mutex> lock(mutex);
+    return records.size();
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <glm/glm.hpp>
+
+// Indirect light arriving at a point, with its translational gradient so it
+// can be extrapolated to nearby points
+struct IrradianceRecord {
+    glm::vec3 pos, normal;
+    glm::vec3 irradiance;
+    // Column c is the gradient of color channel c
+    glm::mat3 gradient;
+    // Distance the record is valid for, from the distances to the geometry
+    // around it
+    float radius;
+};
+
+// One hemisphere sample a record is made from
+struct IrradianceSample {
+    glm::vec3 dir;
+    glm::vec3 radiance;
+    // Distance to what the sample hit, infinite if it hit nothing
+    float distance;
+};
+
+// Ward-style irradiance cache for the diffuse walls. Records are stored in a
+// hash grid with cells the size of the largest radius, so a lookup only has
+// to look at the cell the point is in. Records are added lazily while
+// rendering and kept across frames until something they depend on changes.
+class IrradianceCache {
+  public:
+    // Drop every record if the parameters or sceneKey, which should describe
+    // everything the cached light depends on, differ from the last call
+    void update(float maxError, float minRadius, float maxRadius, const std::string &sceneKey);
+    // Interpolated irradiance at pos, false if no record is close enough
+    bool lookup(const glm::vec3 &pos, const glm::vec3 &normal, glm::vec3 &irradiance) const;
+    IrradianceRecord createRecord(const glm::vec3 &pos, const glm::vec3 &normal,
+                                  const std::vector<IrradianceSample> &samples) const;
+    void add(const IrradianceRecord &record);
+    size_t size() const;
+
+  private:
+    uint64_t cellKey(const glm::ivec3 &cell) const;
+    glm::ivec3 cellOf(const glm::vec3 &p) const;
+
+    float maxError = 0, minRadius = 0, maxRadius = 0;
+    std::string sceneKey;
+    std::vector<IrradianceRecord> records;
+    std::unordered_map<uint64_t, std::vector<int>> cells;
+    mutable std::shared_mutex mutex;
+};
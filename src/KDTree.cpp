@@ -1,128 +1,17 @@
 #include "KDTree.h"
-#include "Portal.h"
-#include "PortalOutline.h"
 #include <glm/glm.hpp>
 #include <algorithm>
-#include "Box.h"
+#include <cstdint>
 
 using namespace glm;
 using namespace std;
 
-#define EPSILON 0.00001
-
-bool SurfaceInteraction::operator<(const SurfaceInteraction &rhs) {
-    if (abs(d - rhs.d) < 0.0001) {
-        if (dynamic_cast<Portal *>(tri->obj)) {
-            return true;
-        }
-        else if (dynamic_cast<Portal *>(rhs.tri->obj)) {
-            return false;
-        }
-        else if (dynamic_cast<PortalOutline *>(tri->obj)) {
-            return true;
-        }
-        else if (dynamic_cast<PortalOutline *>(rhs.tri->obj)) {
-            return false;
-        }
-    }
-    return d < rhs.d;
-}
-
-Ray::Ray(glm::vec3 o, glm::vec3 d) : o(o), d(d), tMax(INFINITY) {
-
-}
-
-Ray::Ray(glm::vec3 o, glm::vec3 d, float tMax) : o(o), d(d), tMax(tMax) {
-
-}
-
-bool Bounds3f::IntersectP(const Ray &ray, float *hitt0, float *hitt1) const {
-    float t0 = 0, t1 = ray.tMax;
-    for (int i = 0; i < 3; ++i) {
-        float invRayDir = 1 / ray.d[i];
-        float tNear = (pMin[i] - ray.o[i]) * invRayDir;
-        float tFar  = (pMax[i] - ray.o[i]) * invRayDir;
-        if (tNear > tFar) std::swap(tNear, tFar);
-        tFar *= 1 + 2 * tgamma(3);
-
-        t0 = tNear > t0 ? tNear : t0;
-        t1 = tFar  < t1 ? tFar  : t1;
-        if (t0 > t1) return false;
-
-    }
-    if (hitt0) *hitt0 = t0;
-    if (hitt1) *hitt1 = t1;
-    return true;
-}
-
-void Bounds3f::extend(const Bounds3f &other) {
-    pMin = glm::min(pMin, other.pMin);
-    pMax = glm::max(pMax, other.pMax);
-}
-
-int Bounds3f::MaximumExtent() const {
-    glm::vec3 d = pMax - pMin;
-    if (d.x > d.y && d.x > d.z)
-        return 0;
-    else if (d.y > d.z)
-        return 1;
-    else
-        return 2;
-}
-
-float Bounds3f::SurfaceArea() const {
-    vec3 d = pMax - pMin;
-    return 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
-}
-
-Bounds3f Primitive::WorldBound() const {
-    Bounds3f b;
-    b.pMin = glm::min(verts[0], glm::min(verts[1], verts[2]));
-    b.pMax = glm::max(verts[0], glm::max(verts[1], verts[2]));
-    return b;
-}
-
-
-// https://cadxfem.org/inf/Fast%20MinimumStorage%20RayTriangle%20Intersection.pdf
-bool Primitive::Intersect(const Ray &r, SurfaceInteraction &si) const {
-    vec3 edge1 = verts[1] - verts[0];
-    vec3 edge2 = verts[2] - verts[0];
-    vec3 pvec = cross(r.d, edge2);
-    float det = dot(edge1, pvec);
-
-    if (det < EPSILON) {
-        return false;
-    }
-
-    vec3 tvec = r.o - verts[0];
-    si.u = dot(tvec, pvec);
-    if (si.u < 0 || si.u > det) {
-        return false;
-    }
-
-    vec3 qvec = cross(tvec, edge1);
-    si.v = dot(r.d, qvec);
-    if (si.v < 0 || si.u + si.v > det) {
-        return false;
-    }
-
-    si.d = dot(edge2, qvec);
-    float inv_det = 1 / det;
-    si.d *= inv_det;
-    si.u *= inv_det;
-    si.v *= inv_det;
-
-    return si.d > -EPSILON;
-}
-
-bool Primitive::IntersectP(const Ray &r) const {
-    SurfaceInteraction si;
-    return Intersect(r, si) && si.d <= r.tMax;
-}
-
 struct KdAccelNode {
     // KdAccelNode Methods
     void InitLeaf(int *primNums, int np, std::vector<int> *primitiveIndices);
+    // Shift child and primitive index offsets when a subtree built on its own
+    // is appended to its parent's arrays
+    void Relocate(int nodeOffset, int indexOffset);
     void InitInterior(int axis, int ac, float s) {
         split = s;
         flags = axis;
@@ -151,98 +40,133 @@ enum class EdgeType { Start, End };
 struct BoundEdge {
     // BoundEdge Public Methods
     BoundEdge() {}
-    BoundEdge(float t, int primNum, bool starting) : t(t), primNum(primNum) {
-        type = starting ? EdgeType::Start : EdgeType::End;
-    }
+    BoundEdge(float t, int primNum, bool starting)
+        : t(t), primAndType((primNum << 1) | (starting ? 0 : 1)) {}
+    int primNum() const { return primAndType >> 1; }
+    EdgeType type() const { return EdgeType(primAndType & 1); }
     float t;
-    int primNum;
-    EdgeType type;
+    // Primitive number in the upper bits and the edge type in the lowest one,
+    // which keeps edges at 8 bytes since they are copied around a lot
+    int primAndType;
 };
 
-void gameObjectToPrimitives(GameObject *obj, const mat4 &transform, std::vector<std::shared_ptr<Primitive>> &tris) {
-    Shape *model = obj->getModel();
-    if (obj->posBufCache.size() != model->posBuf.size()) {
-        obj->posBufCache.resize(model->posBuf.size());
+static bool edgeLess(const BoundEdge &e0, const BoundEdge &e1) {
+    if (e0.t == e1.t)
+        return (int)e0.type() < (int)e1.type();
+    else
+        return e0.t < e1.t;
+}
+
+// Which side(s) of the split plane a primitive goes to in the presorted build
+enum { BelowSplit = 1, AboveSplit = 2 };
+
+// Nodes and scratch memory for building one subtree. Subtrees large enough to
+// be worth forking get their own context so they can be built on another
+// thread, then get appended to their parent's nodes in depth-first order.
+struct KdBuildContext {
+    // Allocate the scratch arrays of the sorting build
+    void initSortScratch(int nPrimitives, int maxDepth) {
+        for (int i = 0; i < 3; ++i)
+            edges[i].reset(new BoundEdge[2 * nPrimitives]);
+        primNums.reset(new int[nPrimitives]);
+        prims0.reset(new int[nPrimitives]);
+        prims1.reset(new int[(maxDepth + 1) * nPrimitives]);
     }
+    void merge(const KdBuildContext &child);
+    std::vector<KdAccelNode> nodes;
+    std::vector<int> primitiveIndices;
 
-    // loop over each face
-    for (int fIdx = 0; fIdx < model->eleBuf.size() / 3; fIdx++) {
-        shared_ptr<Primitive> tri = make_shared<Primitive>();
-        tri->faceIndex = fIdx;
-        tri->obj = obj;
-
-        for (int vNum = 0; vNum < 3; vNum++) {
-            // get transformed vertex coordinates
-            unsigned int vIdx = model->eleBuf[fIdx*3+vNum];
-            for (int i = 0; i < 3; i++) {
-                tri->verts[vNum][i] = model->posBuf[vIdx*3+i];
-            }
-            tri->verts[vNum] = vec3(transform * vec4(tri->verts[vNum], 1));
+    // Sorting build scratch
+    std::unique_ptr<BoundEdge[]> edges[3];
+    std::unique_ptr<int[]> primNums, prims0, prims1;
+
+    // Presorted build scratch. Forked contexts get a pool of their own, and
+    // their own side flags since straddling primitives are in both subtrees.
+    ScratchPool *pool = nullptr;
+    ScratchPool::Lease ownPool;
+    uint8_t *primFlags = nullptr;
+    BoundEdge *rootEdges[3];
+};
 
-            // cache transformed vertex coordinates
-            for (int i = 0; i < 3; i++) {
-                obj->posBufCache[vIdx*3+i] = tri->verts[vNum][i];
-            }
-        }
-        tris.push_back(tri);
+void KdBuildContext::merge(const KdBuildContext &child) {
+    int nodeOffset = nodes.size();
+    int indexOffset = primitiveIndices.size();
+    for (KdAccelNode node : child.nodes) {
+        node.Relocate(nodeOffset, indexOffset);
+        nodes.push_back(node);
     }
+    primitiveIndices.insert(primitiveIndices.end(), child.primitiveIndices.begin(),
+                            child.primitiveIndices.end());
 }
 
-// KdTreeAccel Method Definitions
-std::vector<std::shared_ptr<Primitive>> gameObjectsToPrimitives(const std::list<GameObject *> &gameObjects) {
-    std::vector<std::shared_ptr<Primitive>> tris;
-
-    for (GameObject *obj : gameObjects) {
-        mat4 transform = obj->getTransform();
-        gameObjectToPrimitives(obj, transform, tris);
-        if (dynamic_cast<Box *>(obj)) {
-            Box *box = static_cast<Box *>(obj);
-            for (Portal *portal : box->touchingPortals) {
-                mat4 boxTransform = portal->getTransformToLinkedPortal() * transform;
-                gameObjectToPrimitives(box, boxTransform, tris);
-            }
-        }
-    }
-
-    return tris;
-}
+// Subtrees with fewer primitives than this are built on the current thread
+static const int parallelBuildThreshold = 4096;
 
-KdTreeAccel::KdTreeAccel(const std::list<GameObject *> &gameObjects,
+// KdTreeAccel Method Definitions
+KdTreeAccel::KdTreeAccel(TriangleStore p,
                          int isectCost, int traversalCost, float emptyBonus,
-                         int maxPrims, int maxDepth)
+                         int maxPrims, int maxDepth, KdBuildMode buildMode)
     : isectCost(isectCost),
       traversalCost(traversalCost),
       maxPrims(maxPrims),
       emptyBonus(emptyBonus),
-      primitives(gameObjectsToPrimitives(gameObjects)) {
+      tris(std::move(p)) {
     // Build kd-tree for accelerator
-    nextFreeNode = nAllocedNodes = 0;
     if (maxDepth <= 0)
-        maxDepth = std::round(8 + 1.3f * ceil(log(int64_t(primitives.size()))));
+        maxDepth = std::round(8 + 1.3f * ceil(log(int64_t(tris.size()))));
 
     // Compute bounds for kd-tree construction
     std::vector<Bounds3f> primBounds;
-    primBounds.reserve(primitives.size());
-    for (const std::shared_ptr<Primitive> &prim : primitives) {
-        Bounds3f b = prim->WorldBound();
+    primBounds.reserve(tris.size());
+    for (int i = 0; i < tris.size(); ++i) {
+        Bounds3f b = tris.WorldBound(i);
         bounds.extend(b);
         primBounds.push_back(b);
     }
 
-    // Allocate working memory for kd-tree construction
-    std::unique_ptr<BoundEdge[]> edges[3];
-    for (int i = 0; i < 3; ++i)
-        edges[i].reset(new BoundEdge[2 * primitives.size()]);
-    std::unique_ptr<int[]> prims0(new int[primitives.size()]);
-    std::unique_ptr<int[]> prims1(new int[(maxDepth + 1) * primitives.size()]);
-
-    // Initialize _primNums_ for kd-tree construction
-    std::unique_ptr<int[]> primNums(new int[primitives.size()]);
-    for (size_t i = 0; i < primitives.size(); ++i) primNums[i] = i;
-
-    // Start recursive construction of kd-tree
-    buildTree(0, bounds, primBounds, primNums.get(), primitives.size(),
-              maxDepth, edges, prims0.get(), prims1.get());
+    // Small meshes are built on the calling thread, starting a parallel
+    // region would cost more than it saves
+    bool parallel = tris.size() >= parallelBuildThreshold;
+    KdBuildContext ctx;
+    if (buildMode == KdBuildMode::Presorted) {
+        // Sort the edges along every axis once, children keep them sorted.
+        // The pool is borrowed for the build and keeps its blocks for the
+        // next one.
+        ctx.ownPool = ScratchPool::acquire();
+        ctx.pool = ctx.ownPool.get();
+        ctx.primFlags = ctx.pool->alloc<uint8_t>(tris.size());
+        std::fill(ctx.primFlags, ctx.primFlags + tris.size(), 0);
+        for (int axis = 0; axis < 3; ++axis)
+            ctx.rootEdges[axis] = ctx.pool->alloc<BoundEdge>(2 * tris.size());
+        #pragma omp parallel for if(parallel)
+        for (int axis = 0; axis < 3; ++axis) {
+            BoundEdge *edges = ctx.rootEdges[axis];
+            for (int i = 0; i < tris.size(); ++i) {
+                edges[2 * i] = BoundEdge(primBounds[i].pMin[axis], i, true);
+                edges[2 * i + 1] = BoundEdge(primBounds[i].pMax[axis], i, false);
+            }
+            std::sort(edges, edges + 2 * tris.size(), edgeLess);
+        }
+
+        #pragma omp parallel if(parallel)
+        #pragma omp single
+        buildTreePresorted(ctx, 0, bounds, ctx.rootEdges, tris.size(), maxDepth);
+    } else {
+        // Allocate working memory for kd-tree construction
+        ctx.initSortScratch(tris.size(), maxDepth);
+
+        // Initialize _primNums_ for kd-tree construction
+        for (int i = 0; i < tris.size(); ++i) ctx.primNums[i] = i;
+
+        // Start recursive construction of kd-tree, large subtrees are forked
+        // off as tasks
+        #pragma omp parallel if(parallel)
+        #pragma omp single
+        buildTree(ctx, 0, bounds, primBounds, ctx.primNums.get(), tris.size(),
+                  maxDepth, ctx.prims0.get(), ctx.prims1.get());
+    }
+    nodes = std::move(ctx.nodes);
+    primitiveIndices = std::move(ctx.primitiveIndices);
 }
 
 void KdAccelNode::InitLeaf(int *primNums, int np,
@@ -260,29 +184,27 @@ void KdAccelNode::InitLeaf(int *primNums, int np,
     }
 }
 
-KdTreeAccel::~KdTreeAccel() { delete[] nodes; }
+void KdAccelNode::Relocate(int nodeOffset, int indexOffset) {
+    if (!IsLeaf())
+        aboveChild += (nodeOffset << 2);
+    else if (nPrimitives() > 1)
+        primitiveIndicesOffset += indexOffset;
+}
+
+KdTreeAccel::~KdTreeAccel() {}
 
-void KdTreeAccel::buildTree(int nodeNum, const Bounds3f &nodeBounds,
+void KdTreeAccel::buildTree(KdBuildContext &ctx, int nodeNum,
+                            const Bounds3f &nodeBounds,
                             const std::vector<Bounds3f> &allPrimBounds,
                             int *primNums, int nPrimitives, int depth,
-                            const std::unique_ptr<BoundEdge[]> edges[3],
                             int *prims0, int *prims1, int badRefines) {
     // Get next free node from _nodes_ array
-    if (nextFreeNode == nAllocedNodes) {
-        int nNewAllocNodes = std::max(2 * nAllocedNodes, 512);
-        KdAccelNode *n = new KdAccelNode[nNewAllocNodes];
-        if (nAllocedNodes > 0) {
-            memcpy(n, nodes, nAllocedNodes * sizeof(KdAccelNode));
-            delete[] nodes;
-        }
-        nodes = n;
-        nAllocedNodes = nNewAllocNodes;
-    }
-    ++nextFreeNode;
+    ctx.nodes.emplace_back();
+    const std::unique_ptr<BoundEdge[]> *edges = ctx.edges;
 
     // Initialize leaf node if termination criteria met
     if (nPrimitives <= maxPrims || depth == 0) {
-        nodes[nodeNum].InitLeaf(primNums, nPrimitives, &primitiveIndices);
+        ctx.nodes[nodeNum].InitLeaf(primNums, nPrimitives, &ctx.primitiveIndices);
         return;
     }
 
@@ -292,9 +214,6 @@ void KdTreeAccel::buildTree(int nodeNum, const Bounds3f &nodeBounds,
     int bestAxis = -1, bestOffset = -1;
     float bestCost = INFINITY;
     float oldCost = isectCost * float(nPrimitives);
-    float totalSA = nodeBounds.SurfaceArea();
-    float invTotalSA = 1 / totalSA;
-    glm::vec3 d = nodeBounds.pMax - nodeBounds.pMin;
 
     // Choose which axis to split along
     int axis = nodeBounds.MaximumExtent();
@@ -310,19 +229,76 @@ retrySplit:
     }
 
     // Sort _edges_ for _axis_
-    std::sort(&edges[axis][0], &edges[axis][2 * nPrimitives],
-              [](const BoundEdge &e0, const BoundEdge &e1) -> bool {
-                  if (e0.t == e1.t)
-                      return (int)e0.type < (int)e1.type;
-                  else
-                      return e0.t < e1.t;
-              });
+    std::sort(&edges[axis][0], &edges[axis][2 * nPrimitives], edgeLess);
+
+    // Compute cost of all splits for _axis_ to find best
+    findBestSplit(nodeBounds, nPrimitives, axis, edges[axis].get(), bestCost,
+                  bestAxis, bestOffset);
+
+    // Create leaf if no good splits were found
+    if (bestAxis == -1 && retries < 2) {
+        ++retries;
+        axis = (axis + 1) % 3;
+        goto retrySplit;
+    }
+    if (bestCost > oldCost) ++badRefines;
+    if ((bestCost > 4 * oldCost && nPrimitives < 16) || bestAxis == -1 ||
+        badRefines == 3) {
+        ctx.nodes[nodeNum].InitLeaf(primNums, nPrimitives, &ctx.primitiveIndices);
+        return;
+    }
+
+    // Classify primitives with respect to split
+    int n0 = 0, n1 = 0;
+    for (int i = 0; i < bestOffset; ++i)
+        if (edges[bestAxis][i].type() == EdgeType::Start)
+            prims0[n0++] = edges[bestAxis][i].primNum();
+    for (int i = bestOffset + 1; i < 2 * nPrimitives; ++i)
+        if (edges[bestAxis][i].type() == EdgeType::End)
+            prims1[n1++] = edges[bestAxis][i].primNum();
+
+    // Recursively initialize children nodes
+    float tSplit = edges[bestAxis][bestOffset].t;
+    Bounds3f bounds0 = nodeBounds, bounds1 = nodeBounds;
+    bounds0.pMax[bestAxis] = bounds1.pMin[bestAxis] = tSplit;
+    if (n1 >= parallelBuildThreshold) {
+        // Build the above subtree into its own context on another thread
+        // while this one carries on with the below subtree
+        std::unique_ptr<KdBuildContext> aboveCtx(new KdBuildContext);
+        aboveCtx->initSortScratch(n1, depth - 1);
+        std::copy(prims1, prims1 + n1, aboveCtx->primNums.get());
+        KdBuildContext *above = aboveCtx.get();
+        #pragma omp task firstprivate(above, bounds1, n1, depth, badRefines) shared(allPrimBounds)
+        buildTree(*above, 0, bounds1, allPrimBounds, above->primNums.get(), n1,
+                  depth - 1, above->prims0.get(), above->prims1.get(), badRefines);
+        buildTree(ctx, nodeNum + 1, bounds0, allPrimBounds, prims0, n0, depth - 1,
+                  prims0, prims1 + nPrimitives, badRefines);
+        #pragma omp taskwait
+        ctx.nodes[nodeNum].InitInterior(bestAxis, ctx.nodes.size(), tSplit);
+        ctx.merge(*above);
+        return;
+    }
+    buildTree(ctx, nodeNum + 1, bounds0, allPrimBounds, prims0, n0, depth - 1,
+              prims0, prims1 + nPrimitives, badRefines);
+    int aboveChild = ctx.nodes.size();
+    ctx.nodes[nodeNum].InitInterior(bestAxis, aboveChild, tSplit);
+    buildTree(ctx, aboveChild, bounds1, allPrimBounds, prims1, n1, depth - 1,
+              prims0, prims1 + nPrimitives, badRefines);
+}
+
+void KdTreeAccel::findBestSplit(const Bounds3f &nodeBounds, int nPrimitives,
+                                int axis, const BoundEdge *edges,
+                                float &bestCost, int &bestAxis,
+                                int &bestOffset) const {
+    float totalSA = nodeBounds.SurfaceArea();
+    float invTotalSA = 1 / totalSA;
+    glm::vec3 d = nodeBounds.pMax - nodeBounds.pMin;
 
     // Compute cost of all splits for _axis_ to find best
     int nBelow = 0, nAbove = nPrimitives;
     for (int i = 0; i < 2 * nPrimitives; ++i) {
-        if (edges[axis][i].type == EdgeType::End) --nAbove;
-        float edgeT = edges[axis][i].t;
+        if (edges[i].type() == EdgeType::End) --nAbove;
+        float edgeT = edges[i].t;
         if (edgeT > nodeBounds.pMin[axis] && edgeT < nodeBounds.pMax[axis]) {
             // Compute cost for split at _i_th edge
 
@@ -348,41 +324,126 @@ retrySplit:
                 bestOffset = i;
             }
         }
-        if (edges[axis][i].type == EdgeType::Start) ++nBelow;
+        if (edges[i].type() == EdgeType::Start) ++nBelow;
     }
+}
 
-    // Create leaf if no good splits were found
-    if (bestAxis == -1 && retries < 2) {
-        ++retries;
+void KdTreeAccel::initLeafPresorted(KdBuildContext &ctx, int nodeNum,
+                                    BoundEdge *const edges[3], int nPrimitives) {
+    // Every primitive has exactly one start edge per axis
+    ScratchPool::Mark mark = ctx.pool->mark();
+    int *primNums = ctx.pool->alloc<int>(nPrimitives);
+    for (int i = 0, n = 0; i < 2 * nPrimitives; ++i)
+        if (edges[0][i].type() == EdgeType::Start)
+            primNums[n++] = edges[0][i].primNum();
+    ctx.nodes[nodeNum].InitLeaf(primNums, nPrimitives, &ctx.primitiveIndices);
+    ctx.pool->release(mark);
+}
+
+void KdTreeAccel::buildTreePresorted(KdBuildContext &ctx, int nodeNum,
+                                     const Bounds3f &nodeBounds,
+                                     BoundEdge *const edges[3], int nPrimitives,
+                                     int depth, int badRefines) {
+    ctx.nodes.emplace_back();
+
+    // Initialize leaf node if termination criteria met
+    if (nPrimitives <= maxPrims || depth == 0) {
+        initLeafPresorted(ctx, nodeNum, edges, nPrimitives);
+        return;
+    }
+
+    // Choose split axis position for interior node, the edges along every
+    // axis are already sorted
+    int bestAxis = -1, bestOffset = -1;
+    float bestCost = INFINITY;
+    float oldCost = isectCost * float(nPrimitives);
+    int axis = nodeBounds.MaximumExtent();
+    for (int retries = 0; retries < 3 && bestAxis == -1; ++retries) {
+        findBestSplit(nodeBounds, nPrimitives, axis, edges[axis], bestCost,
+                      bestAxis, bestOffset);
         axis = (axis + 1) % 3;
-        goto retrySplit;
     }
+
+    // Create leaf if no good splits were found
     if (bestCost > oldCost) ++badRefines;
     if ((bestCost > 4 * oldCost && nPrimitives < 16) || bestAxis == -1 ||
         badRefines == 3) {
-        nodes[nodeNum].InitLeaf(primNums, nPrimitives, &primitiveIndices);
+        initLeafPresorted(ctx, nodeNum, edges, nPrimitives);
         return;
     }
 
     // Classify primitives with respect to split
+    uint8_t *primFlags = ctx.primFlags;
     int n0 = 0, n1 = 0;
     for (int i = 0; i < bestOffset; ++i)
-        if (edges[bestAxis][i].type == EdgeType::Start)
-            prims0[n0++] = edges[bestAxis][i].primNum;
+        if (edges[bestAxis][i].type() == EdgeType::Start) {
+            primFlags[edges[bestAxis][i].primNum()] |= BelowSplit;
+            ++n0;
+        }
     for (int i = bestOffset + 1; i < 2 * nPrimitives; ++i)
-        if (edges[bestAxis][i].type == EdgeType::End)
-            prims1[n1++] = edges[bestAxis][i].primNum;
+        if (edges[bestAxis][i].type() == EdgeType::End) {
+            primFlags[edges[bestAxis][i].primNum()] |= AboveSplit;
+            ++n1;
+        }
 
-    // Recursively initialize children nodes
     float tSplit = edges[bestAxis][bestOffset].t;
     Bounds3f bounds0 = nodeBounds, bounds1 = nodeBounds;
     bounds0.pMax[bestAxis] = bounds1.pMin[bestAxis] = tSplit;
-    buildTree(nodeNum + 1, bounds0, allPrimBounds, prims0, n0, depth - 1, edges,
-              prims0, prims1 + nPrimitives, badRefines);
-    int aboveChild = nextFreeNode;
-    nodes[nodeNum].InitInterior(bestAxis, aboveChild, tSplit);
-    buildTree(aboveChild, bounds1, allPrimBounds, prims1, n1, depth - 1, edges,
-              prims0, prims1 + nPrimitives, badRefines);
+
+    // Large above subtrees are built into their own context on another thread
+    std::unique_ptr<KdBuildContext> aboveCtx;
+    ScratchPool::Mark mark = ctx.pool->mark();
+    ScratchPool *abovePool = ctx.pool;
+    if (n1 >= parallelBuildThreshold) {
+        aboveCtx.reset(new KdBuildContext);
+        aboveCtx->ownPool = ScratchPool::acquire();
+        aboveCtx->pool = abovePool = aboveCtx->ownPool.get();
+        aboveCtx->primFlags = abovePool->alloc<uint8_t>(tris.size());
+        std::fill(aboveCtx->primFlags, aboveCtx->primFlags + tris.size(), 0);
+    }
+
+    // Split the sorted edges stably. The below edges are compacted in place,
+    // the above ones are copied out.
+    BoundEdge *edges1[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        // One spare slot since every edge is written to both lists and only
+        // kept where it belongs
+        edges1[axis] = abovePool->alloc<BoundEdge>(2 * n1 + 1);
+        BoundEdge *e0 = edges[axis], *e1 = edges1[axis];
+        int k0 = 0, k1 = 0;
+        for (int i = 0; i < 2 * nPrimitives; ++i) {
+            const BoundEdge e = e0[i];
+            int side = primFlags[e.primNum()];
+            e1[k1] = e;
+            k1 += side >> 1;
+            e0[k0] = e;
+            k0 += side & BelowSplit;
+        }
+    }
+    for (int i = 0; i < 2 * n0; ++i) primFlags[edges[bestAxis][i].primNum()] = 0;
+    for (int i = 0; i < 2 * n1; ++i) primFlags[edges1[bestAxis][i].primNum()] = 0;
+
+    // Recursively initialize children nodes
+    if (aboveCtx) {
+        KdBuildContext *above = aboveCtx.get();
+        std::copy(edges1, edges1 + 3, above->rootEdges);
+        #pragma omp task firstprivate(above, bounds1, n1, depth, badRefines)
+        buildTreePresorted(*above, 0, bounds1, above->rootEdges, n1, depth - 1,
+                           badRefines);
+        buildTreePresorted(ctx, nodeNum + 1, bounds0, edges, n0, depth - 1,
+                           badRefines);
+        #pragma omp taskwait
+        ctx.nodes[nodeNum].InitInterior(bestAxis, ctx.nodes.size(), tSplit);
+        ctx.merge(*above);
+        return;
+    }
+    buildTreePresorted(ctx, nodeNum + 1, bounds0, edges, n0, depth - 1,
+                       badRefines);
+    int aboveChild = ctx.nodes.size();
+    ctx.nodes[nodeNum].InitInterior(bestAxis, aboveChild, tSplit);
+    buildTreePresorted(ctx, aboveChild, bounds1, edges1, n1, depth - 1,
+                       badRefines);
+    ctx.pool->release(mark);
 }
 
 bool KdTreeAccel::Intersect(const Ray &ray, SurfaceInteraction &isect) const {
@@ -442,12 +503,9 @@ bool KdTreeAccel::Intersect(const Ray &ray, SurfaceInteraction &isect) const {
             // Check for intersections inside leaf node
             int nPrimitives = node->nPrimitives();
             if (nPrimitives == 1) {
-                const std::shared_ptr<Primitive> &p =
-                    primitives[node->onePrimitive];
                 // Check one primitive inside leaf node
                 SurfaceInteraction newIsect;
-                newIsect.tri = p.get();
-                if (p->Intersect(ray, newIsect)) {
+                if (tris.Intersect(node->onePrimitive, ray, newIsect)) {
                     if (hit) {
                         if (newIsect < isect) {
                             isect = newIsect;
@@ -462,11 +520,9 @@ bool KdTreeAccel::Intersect(const Ray &ray, SurfaceInteraction &isect) const {
                 for (int i = 0; i < nPrimitives; ++i) {
                     int index =
                         primitiveIndices[node->primitiveIndicesOffset + i];
-                    const std::shared_ptr<Primitive> &p = primitives[index];
                     // Check one primitive inside leaf node
                     SurfaceInteraction newIsect;
-                    newIsect.tri = p.get();
-                    if (p->Intersect(ray, newIsect)) {
+                    if (tris.Intersect(index, ray, newIsect)) {
                         if (hit) {
                             if (newIsect < isect) {
                                 isect = newIsect;
@@ -511,18 +567,14 @@ bool KdTreeAccel::IntersectP(const Ray &ray) const {
             // Check for shadow ray intersections inside leaf node
             int nPrimitives = node->nPrimitives();
             if (nPrimitives == 1) {
-                const std::shared_ptr<Primitive> &p =
-                    primitives[node->onePrimitive];
-                if (p->IntersectP(ray)) {
+                if (tris.IntersectP(node->onePrimitive, ray)) {
                     return true;
                 }
             } else {
                 for (int i = 0; i < nPrimitives; ++i) {
                     int primitiveIndex =
                         primitiveIndices[node->primitiveIndicesOffset + i];
-                    const std::shared_ptr<Primitive> &prim =
-                        primitives[primitiveIndex];
-                    if (prim->IntersectP(ray)) {
+                    if (tris.IntersectP(primitiveIndex, ray)) {
                         return true;
                     }
                 }
@@ -574,3 +626,208 @@ bool KdTreeAccel::IntersectP(const Ray &ray) const {
     }
     return false;
 }
+
+
+int KdTreeAccel::Intersect(const RayPacket &packet, SurfaceInteraction isect[RayPacket::Size]) const {
+    // Compute initial parametric range of each ray inside kd-tree extent
+    float4 tMin, tMax;
+    int active = bounds.IntersectP(packet, &tMin, &tMax);
+    if (!active) {
+        return 0;
+    }
+
+    // Prepare to traverse kd-tree for packet
+    const int maxTodo = 64;
+    KdPacketToDo todo[maxTodo];
+    int todoPos = 0;
+
+    // Traverse kd-tree nodes in order for packet
+    int hit = 0;
+    float hitDist[RayPacket::Size] = { INFINITY, INFINITY, INFINITY, INFINITY };
+    const KdAccelNode *node = &nodes[0];
+    while (true) {
+        // Retire lanes that found a hit closer than the current node
+        active &= ~movemask(float4::load(hitDist) < tMin);
+        if (active && !node->IsLeaf()) {
+            // Process kd-tree interior node
+
+            // Compute parametric distance along each ray to split plane
+            int axis = node->SplitAxis();
+            float4 split(node->SplitPos());
+            float4 tPlane = (split - packet.o[axis]) * packet.invDir[axis];
+
+            // Get node children pointers for packet. The lanes have to agree
+            // on which child comes first, otherwise trace them one at a time.
+            int belowFirst = active & movemask((packet.o[axis] < split) |
+                ((packet.o[axis] == split) & (packet.d[axis] <= float4(0.f))));
+            if (belowFirst != 0 && belowFirst != active) {
+                int hits = 0;
+                for (int lane = 0; lane < RayPacket::Size; lane++) {
+                    if ((packet.active & (1 << lane)) && Intersect(packet.ray(lane), isect[lane])) {
+                        hits |= 1 << lane;
+                    }
+                }
+                return hits;
+            }
+            const KdAccelNode *firstChild, *secondChild;
+            if (belowFirst) {
+                firstChild = node + 1;
+                secondChild = &nodes[node->AboveChild()];
+            } else {
+                firstChild = &nodes[node->AboveChild()];
+                secondChild = node + 1;
+            }
+
+            // Advance to next child node, possibly enqueue other child
+            float4 onlyFirst = (tPlane > tMax) | (tPlane <= float4(0.f));
+            float4 notBoth = onlyFirst | (tPlane < tMin);
+            int firstActive = active & ~(movemask(notBoth) & ~movemask(onlyFirst));
+            int secondActive = active & ~movemask(onlyFirst);
+            if (!secondActive)
+                node = firstChild;
+            else if (!firstActive)
+                node = secondChild;
+            else {
+                // Enqueue _secondChild_ in todo list
+                todo[todoPos].node = secondChild;
+                todo[todoPos].tMin = select(notBoth, tMin, tPlane);
+                todo[todoPos].tMax = tMax;
+                todo[todoPos].active = secondActive;
+                ++todoPos;
+                node = firstChild;
+                tMax = select(notBoth, tMax, tPlane);
+                active = firstActive;
+            }
+            continue;
+        }
+
+        if (active) {
+            // Check for intersections inside leaf node
+            int nPrimitives = node->nPrimitives();
+            for (int i = 0; i < nPrimitives; ++i) {
+                int index = nPrimitives == 1 ? node->onePrimitive :
+                    primitiveIndices[node->primitiveIndicesOffset + i];
+                SurfaceInteraction newIsect[RayPacket::Size];
+                int hits = tris.Intersect(index, packet, active, newIsect);
+                for (int lane = 0; lane < RayPacket::Size; lane++) {
+                    if (!(hits & (1 << lane))) {
+                        continue;
+                    }
+                    if (!(hit & (1 << lane)) || newIsect[lane] < isect[lane]) {
+                        isect[lane] = newIsect[lane];
+                        hitDist[lane] = newIsect[lane].d;
+                        hit |= 1 << lane;
+                    }
+                }
+            }
+        }
+
+        // Grab next node to process from todo list
+        if (todoPos > 0) {
+            --todoPos;
+            node = todo[todoPos].node;
+            tMin = todo[todoPos].tMin;
+            tMax = todo[todoPos].tMax;
+            active = todo[todoPos].active;
+        } else
+            break;
+    }
+    return hit;
+}
+
+int KdTreeAccel::IntersectP(const RayPacket &packet) const {
+    // Compute initial parametric range of each ray inside kd-tree extent
+    float4 tMin, tMax;
+    int active = bounds.IntersectP(packet, &tMin, &tMax);
+    if (!active) {
+        return 0;
+    }
+
+    // Prepare to traverse kd-tree for packet
+    const int maxTodo = 64;
+    KdPacketToDo todo[maxTodo];
+    int todoPos = 0;
+    int occluded = 0;
+    const KdAccelNode *node = &nodes[0];
+    while (true) {
+        active &= ~occluded;
+        if (active && !node->IsLeaf()) {
+            // Process kd-tree interior node
+
+            // Compute parametric distance along each ray to split plane
+            int axis = node->SplitAxis();
+            float4 split(node->SplitPos());
+            float4 tPlane = (split - packet.o[axis]) * packet.invDir[axis];
+
+            // Get node children pointers for packet, falling back to single
+            // rays if the lanes disagree on the traversal order
+            int belowFirst = active & movemask((packet.o[axis] < split) |
+                ((packet.o[axis] == split) & (packet.d[axis] <= float4(0.f))));
+            if (belowFirst != 0 && belowFirst != active) {
+                int hits = 0;
+                for (int lane = 0; lane < RayPacket::Size; lane++) {
+                    if ((packet.active & (1 << lane)) && IntersectP(packet.ray(lane))) {
+                        hits |= 1 << lane;
+                    }
+                }
+                return hits;
+            }
+            const KdAccelNode *firstChild, *secondChild;
+            if (belowFirst) {
+                firstChild = node + 1;
+                secondChild = &nodes[node->AboveChild()];
+            } else {
+                firstChild = &nodes[node->AboveChild()];
+                secondChild = node + 1;
+            }
+
+            // Advance to next child node, possibly enqueue other child
+            float4 onlyFirst = (tPlane > tMax) | (tPlane <= float4(0.f));
+            float4 notBoth = onlyFirst | (tPlane < tMin);
+            int firstActive = active & ~(movemask(notBoth) & ~movemask(onlyFirst));
+            int secondActive = active & ~movemask(onlyFirst);
+            if (!secondActive)
+                node = firstChild;
+            else if (!firstActive)
+                node = secondChild;
+            else {
+                // Enqueue _secondChild_ in todo list
+                todo[todoPos].node = secondChild;
+                todo[todoPos].tMin = select(notBoth, tMin, tPlane);
+                todo[todoPos].tMax = tMax;
+                todo[todoPos].active = secondActive;
+                ++todoPos;
+                node = firstChild;
+                tMax = select(notBoth, tMax, tPlane);
+                active = firstActive;
+            }
+            continue;
+        }
+
+        if (active) {
+            // Check for shadow ray intersections inside leaf node
+            int nPrimitives = node->nPrimitives();
+            for (int i = 0; i < nPrimitives && active; ++i) {
+                int index = nPrimitives == 1 ? node->onePrimitive :
+                    primitiveIndices[node->primitiveIndicesOffset + i];
+                int hits = tris.IntersectP(index, packet, active);
+                occluded |= hits;
+                active &= ~hits;
+            }
+            if (occluded == packet.active) {
+                return occluded;
+            }
+        }
+
+        // Grab next node to process from todo list
+        if (todoPos > 0) {
+            --todoPos;
+            node = todo[todoPos].node;
+            tMin = todo[todoPos].tMin;
+            tMax = todo[todoPos].tMax;
+            active = todo[todoPos].active;
+        } else
+            break;
+    }
+    return occluded;
+}
@@ -1,75 +1,60 @@
 #pragma once
 
 #include <memory>
-#include <list>
+#include <vector>
 #include <glm/glm.hpp>
-#include "GameObject.h"
+#include "Aggregate.h"
+#include "ScratchPool.h"
 
 // http://www.pbr-book.org/3ed-2018/Primitives_and_Intersection_Acceleration/Kd-Tree_Accelerator.html
 
-struct Ray {
-    Ray(glm::vec3 o, glm::vec3 d);
-    Ray(glm::vec3 o, glm::vec3 d, float tMax);
-    glm::vec3 o, d;
-    float tMax;
-};
-
-struct Bounds3f {
-public:
-    void extend(const Bounds3f &other);
-    float SurfaceArea() const;
-    int MaximumExtent() const;
-    bool IntersectP(const Ray &ray, float *hitt0, float *hitt1) const;
-    glm::vec3 pMin, pMax;
-};
-
-class Primitive;
-struct SurfaceInteraction {
-    float d;
-    float u, v;
-    Primitive *tri;
-    bool operator<(const SurfaceInteraction &rhs);
-    bool operator>(const SurfaceInteraction &rhs) { return !operator<(rhs); }
-};
+struct KdAccelNode;
+struct BoundEdge;
+struct KdBuildContext;
 
-class Primitive {
-public:
-    GameObject *obj;
-    glm::vec3 verts[3];
-    int faceIndex;
-    bool Intersect(const Ray &r, SurfaceInteraction &si) const;
-    bool IntersectP(const Ray &r) const;
-    Bounds3f WorldBound() const;
+enum class KdBuildMode {
+    // Sort the edges again at every node
+    Sort,
+    // Sort the edges once and split the sorted lists down the tree
+    Presorted
 };
 
-struct KdAccelNode;
-struct BoundEdge;
-class KdTreeAccel {
+class KdTreeAccel : public Aggregate {
   public:
     // KdTreeAccel Public Methods
-    KdTreeAccel(const std::list<GameObject *> &gameObjects,
+    KdTreeAccel(TriangleStore p,
                 int isectCost = 80, int traversalCost = 1,
-                float emptyBonus = 0.5, int maxPrims = 1, int maxDepth = -1);
+                float emptyBonus = 0.5, int maxPrims = 1, int maxDepth = -1,
+                KdBuildMode buildMode = KdBuildMode::Presorted);
     Bounds3f WorldBound() const { return bounds; }
     ~KdTreeAccel();
     bool Intersect(const Ray &ray, SurfaceInteraction &isect) const;
     bool IntersectP(const Ray &ray) const;
+    // Packet traversal, returns a bitmask of the lanes that hit
+    int Intersect(const RayPacket &packet, SurfaceInteraction isect[RayPacket::Size]) const;
+    int IntersectP(const RayPacket &packet) const;
 
   private:
     // KdTreeAccel Private Methods
-    void buildTree(int nodeNum, const Bounds3f &bounds,
+    void buildTree(KdBuildContext &ctx, int nodeNum, const Bounds3f &bounds,
                    const std::vector<Bounds3f> &primBounds, int *primNums,
-                   int nprims, int depth,
-                   const std::unique_ptr<BoundEdge[]> edges[3], int *prims0,
-                   int *prims1, int badRefines = 0);
+                   int nprims, int depth, int *prims0, int *prims1,
+                   int badRefines = 0);
+    void buildTreePresorted(KdBuildContext &ctx, int nodeNum,
+                            const Bounds3f &bounds, BoundEdge *const edges[3],
+                            int nprims, int depth, int badRefines = 0);
+    void initLeafPresorted(KdBuildContext &ctx, int nodeNum,
+                           BoundEdge *const edges[3], int nprims);
+    void findBestSplit(const Bounds3f &nodeBounds, int nprims, int axis,
+                       const BoundEdge *edges, float &bestCost, int &bestAxis,
+                       int &bestOffset) const;
 
     // KdTreeAccel Private Data
     const int isectCost, traversalCost, maxPrims;
     const float emptyBonus;
-    std::vector<std::shared_ptr<Primitive>> primitives;
+    TriangleStore tris;
     std::vector<int> primitiveIndices;
-    KdAccelNode *nodes;
-    int nAllocedNodes, nextFreeNode;
+    std::vector<KdAccelNode> nodes;
     Bounds3f bounds;
 };
 
@@ -77,3 +62,9 @@ struct KdToDo {
     const KdAccelNode *node;
     float tMin, tMax;
 };
+
+struct KdPacketToDo {
+    const KdAccelNode *node;
+    float4 tMin, tMax;
+    int active;
+};
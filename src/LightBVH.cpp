@@ -0,0 +1,190 @@
+#include "LightBVH.h"
+#include "SceneSnapshot.h"
+#include <algorithm>
+#include <cmath>
+#include <glm/gtc/quaternion.hpp>
+
+using namespace glm;
+using namespace std;
+
+// Distance from a portal's center to its corners. The portal model is a
+// unit square in its xz plane, scaled by the portal.
+static float portalRadius(const Portal &portal) {
+    return length(vec2(portal.scale.x, portal.scale.z));
+}
+
+static float luminance(const glm::vec3 &c) {
+    return dot(c, vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+// Smallest cone holding cones a and b, after pbrt's DirectionCone::Union
+static void unionCones(const glm::vec3 &axisA, float cosA, const glm::vec3 &axisB, float cosB,
+                       glm::vec3 &axis, float &cosSpread) {
+    if (cosA <= -1 || cosB <= -1) {
+        axis = axisA;
+        cosSpread = -1;
+        return;
+    }
+    float thetaA = acos(glm::clamp(cosA, -1.f, 1.f));
+    float thetaB = acos(glm::clamp(cosB, -1.f, 1.f));
+    float thetaD = acos(glm::clamp(dot(axisA, axisB), -1.f, 1.f));
+    if (std::min(thetaD + thetaB, (float) M_PI) <= thetaA) {
+        axis = axisA;
+        cosSpread = cosA;
+        return;
+    }
+    if (std::min(thetaD + thetaA, (float) M_PI) <= thetaB) {
+        axis = axisB;
+        cosSpread = cosB;
+        return;
+    }
+    float thetaO = (thetaA + thetaD + thetaB) / 2;
+    vec3 rotationAxis = cross(axisA, axisB);
+    if (thetaO >= M_PI || dot(rotationAxis, rotationAxis) == 0) {
+        axis = axisA;
+        cosSpread = -1;
+        return;
+    }
+    axis = angleAxis(thetaO - thetaA, normalize(rotationAxis)) * axisA;
+    cosSpread = cos(thetaO);
+}
+
+void LightBVH::build(const SceneSnapshot &scene, float lightRadius) {
+    this->lightRadius = lightRadius;
+    emitters.clear();
+    nodes.clear();
+    // Half the diagonal of a light's square
+    float extent = lightRadius * 0.7072f;
+    for (size_t i = 0; i < scene.lights.size(); i++) {
+        const Light &light = scene.lights[i];
+        float power = luminance(light.intensity);
+        if (power <= 0) {
+            continue;
+        }
+        emitters.push_back({ (int) i, nullptr, light.position, power, vec3(0, 1, 0), -1 });
+
+        // Light behind a portal only leaves through the first portal
+        for (const VirtualLight &virtualLight : scene.virtualLights[i]) {
+            LightEmitter emitter = { (int) i, &virtualLight, vec3(virtualLight.toVirtual[0] * vec4(light.position, 1)),
+                                     power, vec3(0, 1, 0), -1 };
+            const Portal &portal = *virtualLight.portals[0];
+            vec3 toPortal = portal.position - emitter.position;
+            float dist = length(toPortal);
+            float sinSpread = (portalRadius(portal) + extent) / dist;
+            if (sinSpread < 1) {
+                emitter.axis = toPortal / dist;
+                emitter.cosSpread = sqrt(1 - sinSpread * sinSpread);
+            }
+            emitters.push_back(emitter);
+        }
+    }
+    if (emitters.empty()) {
+        return;
+    }
+
+    vector<int> order(emitters.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    nodes.reserve(2 * emitters.size() - 1);
+    buildNode(order, 0, order.size());
+}
+
+int LightBVH::buildNode(std::vector<int> &order, int begin, int end) {
+    int index = nodes.size();
+    nodes.emplace_back();
+    float extent = lightRadius * 0.7072f;
+    if (end - begin == 1) {
+        const LightEmitter &emitter = emitters[order[begin]];
+        Node &leaf = nodes[index];
+        leaf.boundsMin = emitter.position - extent;
+        leaf.boundsMax = emitter.position + extent;
+        leaf.power = emitter.power;
+        leaf.axis = emitter.axis;
+        leaf.cosSpread = emitter.cosSpread;
+        leaf.emitter = order[begin];
+        return index;
+    }
+
+    // Split at the median of the widest axis of the emitter positions
+    vec3 centerMin(INFINITY), centerMax(-INFINITY);
+    for (int i = begin; i < end; i++) {
+        centerMin = min(centerMin, emitters[order[i]].position);
+        centerMax = max(centerMax, emitters[order[i]].position);
+    }
+    vec3 size = centerMax - centerMin;
+    int axis = size.x > size.y && size.x > size.z ? 0 : (size.y > size.z ? 1 : 2);
+    int mid = (begin + end) / 2;
+    nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+                [&](int a, int b) { return emitters[a].position[axis] < emitters[b].position[axis]; });
+
+    buildNode(order, begin, mid);
+    int second = buildNode(order, mid, end);
+    // Children may have grown the vector, so only take the reference now
+    Node &node = nodes[index];
+    const Node &a = nodes[index + 1], &b = nodes[second];
+    node.boundsMin = min(a.boundsMin, b.boundsMin);
+    node.boundsMax = max(a.boundsMax, b.boundsMax);
+    node.power = a.power + b.power;
+    unionCones(a.axis, a.cosSpread, b.axis, b.cosSpread, node.axis, node.cosSpread);
+    node.secondChild = second;
+    return index;
+}
+
+// Upper bound of the light a node's emitters can send to a point at p with
+// normal n, after pbrt's LightBounds::Importance
+float LightBVH::importance(const Node &node, const glm::vec3 &p, const glm::vec3 &n) const {
+    vec3 center = (node.boundsMin + node.boundsMax) / 2.f;
+    float radius = length(node.boundsMax - node.boundsMin) / 2;
+    vec3 toPoint = p - center;
+    float distSq = dot(toPoint, toPoint);
+    if (distSq <= radius * radius) {
+        // Inside the bounds light can come from anywhere
+        return node.power / std::max(radius * radius, 1e-4f);
+    }
+
+    // Angle the bounds take up as seen from p
+    float thetaBounds = asin(radius / sqrt(distSq));
+    vec3 wi = toPoint / sqrt(distSq);
+    if (node.cosSpread > -1) {
+        float thetaW = acos(glm::clamp(dot(node.axis, wi), -1.f, 1.f));
+        if (thetaW - acos(node.cosSpread) - thetaBounds > 0) {
+            return 0;
+        }
+    }
+    // Light arriving from behind the surface does not count
+    float thetaI = acos(glm::clamp(dot(n, -wi), -1.f, 1.f));
+    float cosI = cos(std::max(0.f, thetaI - thetaBounds));
+    if (cosI <= 0) {
+        return 0;
+    }
+    return node.power * cosI / distSq;
+}
+
+const LightEmitter *LightBVH::sample(const glm::vec3 &p, const glm::vec3 &n, float u, float &pdf) const {
+    if (nodes.empty() || importance(nodes[0], p, n) <= 0) {
+        return nullptr;
+    }
+    const float oneMinusEpsilon = 0x1.fffffep-1;
+    int index = 0;
+    pdf = 1;
+    while (nodes[index].emitter < 0) {
+        int first = index + 1, second = nodes[index].secondChild;
+        float importanceFirst = importance(nodes[first], p, n);
+        float importanceSecond = importance(nodes[second], p, n);
+        if (importanceFirst + importanceSecond <= 0) {
+            return nullptr;
+        }
+        float pFirst = importanceFirst / (importanceFirst + importanceSecond);
+        if (u < pFirst) {
+            index = first;
+            u = std::min(u / pFirst, oneMinusEpsilon);
+            pdf *= pFirst;
+        } else {
+            index = second;
+            u = std::min((u - pFirst) / (1 - pFirst), oneMinusEpsilon);
+            pdf *= 1 - pFirst;
+        }
+    }
+    return &emitters[nodes[index].emitter];
+}
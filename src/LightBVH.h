@@ -0,0 +1,58 @@
+#pragma once
+
+#include <vector>
+#include <glm/glm.hpp>
+
+struct SceneSnapshot;
+struct VirtualLight;
+
+// A light as the light tree sees it, either a light itself or one of its
+// virtual lights behind a portal
+struct LightEmitter {
+    // Index into SceneSnapshot::lights
+    int light;
+    // Null for the light itself
+    const VirtualLight *virtualLight;
+    // Where the light appears from, and the luminance of its intensity
+    glm::vec3 position;
+    float power;
+    // Cone of directions the light leaves in, cosSpread is -1 for lights
+    // shining everywhere
+    glm::vec3 axis;
+    float cosSpread;
+};
+
+// Bounding-cone light BVH. Every node bounds the positions, power and
+// emission directions of its emitters, so an upper bound of their
+// contribution to a point can be estimated without visiting them. Sampling
+// walks down from the root choosing children in proportion to that
+// estimate, which keeps the cost of picking a light logarithmic in the
+// number of lights.
+class LightBVH {
+  public:
+    // Emitters for the lights and virtual lights of scene, which are squares
+    // lightRadius wide
+    void build(const SceneSnapshot &scene, float lightRadius);
+    // Pick an emitter for a hit at p with normal n using u in [0, 1). Returns
+    // null if no light can reach p, otherwise pdf is the chance of the pick.
+    const LightEmitter *sample(const glm::vec3 &p, const glm::vec3 &n, float u, float &pdf) const;
+    bool empty() const { return nodes.empty(); }
+
+  private:
+    struct Node {
+        glm::vec3 boundsMin, boundsMax;
+        float power;
+        glm::vec3 axis;
+        float cosSpread;
+        // Leaves hold one emitter, inner nodes have their first child right
+        // after them and the second at secondChild
+        int emitter = -1;
+        int secondChild = -1;
+    };
+    int buildNode(std::vector<int> &order, int begin, int end);
+    float importance(const Node &node, const glm::vec3 &p, const glm::vec3 &n) const;
+
+    float lightRadius = 0;
+    std::vector<LightEmitter> emitters;
+    std::vector<Node> nodes;
+};
@@ -0,0 +1,124 @@
+#include "LightResampler.h"
+#include "SceneSnapshot.h"
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+using namespace glm;
+using namespace std;
+
+void Reservoir::add(const LightSample &candidate, float w, float count, float u) {
+    weightSum += w;
+    this->count += count;
+    if (w > 0 && u * weightSum < w) {
+        sample = candidate;
+    }
+}
+
+void Reservoir::finalize(float target) {
+    weight = target > 0 && count > 0 ? weightSum / (count * target) : 0;
+}
+
+void LightResampler::beginFrame(const PinholeCamera &camera, int width, int height, const SceneSnapshot &scene,
+                                float depthTolerance, int historyLimit) {
+    // Samples point at lights and their portal chains by index, so they only
+    // carry over while the lights and the portals stay the same
+    ostringstream fullKey;
+    fullKey << width << "x" << height;
+    for (const Light &light : scene.lights) {
+        fullKey << " " << light.position.x << "," << light.position.y << "," << light.position.z << ","
+                << light.intensity.x << "," << light.intensity.y << "," << light.intensity.z;
+    }
+    fullKey << " " << scene.portalKey();
+    if (fullKey.str() != key) {
+        hasHistory = false;
+        frameCount = 0;
+        key = fullKey.str();
+    }
+    this->depthTolerance = depthTolerance;
+    this->historyLimit = historyLimit;
+
+    current.camera = camera;
+    current.width = width;
+    current.height = height;
+    current.surfaces.assign(width * height, ResamplingSurface());
+    current.reservoirs.assign(width * height, Reservoir());
+    initial.assign(width * height, Reservoir());
+}
+
+void LightResampler::setInitial(int pixelIdx, const ResamplingSurface &surface, const Reservoir &reservoir) {
+    current.surfaces[pixelIdx] = surface;
+    initial[pixelIdx] = reservoir;
+}
+
+bool LightResampler::similar(const ResamplingSurface &a, const ResamplingSurface &b) const {
+    return a.obj == b.obj && dot(a.normal, b.normal) > 0.9f && abs(a.depth - b.depth) <= depthTolerance * a.depth;
+}
+
+Reservoir &LightResampler::reuseTemporal(int pixelIdx, const Target &target, Sampler &sampler) {
+    Reservoir &reservoir = initial[pixelIdx];
+    const ResamplingSurface &surface = current.surfaces[pixelIdx];
+    vec2 pixel;
+    if (!hasHistory || !surface.obj || !history.camera.project(surface.pos, pixel)) {
+        return reservoir;
+    }
+    int x = (int) round(pixel.x), y = (int) round(pixel.y);
+    if (x < 0 || y < 0 || x >= history.width || y >= history.height) {
+        return reservoir;
+    }
+
+    // Disoccluded pixels saw something else last frame
+    int idx = y * history.width + x;
+    const ResamplingSurface &before = history.surfaces[idx];
+    float depth = distance(history.camera.eye, surface.pos);
+    if (before.obj != surface.obj || dot(before.normal, surface.normal) <= 0.9f ||
+        abs(depth - before.depth) > depthTolerance * before.depth) {
+        return reservoir;
+    }
+
+    // Old samples stop counting for more than historyLimit times the new
+    // candidates, so the reservoir keeps up with changes
+    const Reservoir &previous = history.reservoirs[idx];
+    float previousCount = std::min(previous.count, historyLimit * std::max(reservoir.count, 1.f));
+    Reservoir merged;
+    merged.add(reservoir.sample, target(reservoir.sample) * reservoir.weight * reservoir.count, reservoir.count,
+               sampler.get1D());
+    merged.add(previous.sample, target(previous.sample) * previous.weight * previousCount, previousCount,
+               sampler.get1D());
+    merged.finalize(target(merged.sample));
+    reservoir = merged;
+    return reservoir;
+}
+
+void LightResampler::reuseSpatial(int x, int y, int numNeighbors, float radius, const Target &target, Sampler &sampler) {
+    int pixelIdx = y * current.width + x;
+    const ResamplingSurface &surface = current.surfaces[pixelIdx];
+    if (!surface.obj) {
+        return;
+    }
+    const Reservoir &own = initial[pixelIdx];
+    Reservoir merged;
+    merged.add(own.sample, target(own.sample) * own.weight * own.count, own.count, sampler.get1D());
+    for (int i = 0; i < numNeighbors; i++) {
+        vec2 offset = (sampler.get2D() * 2.f - 1.f) * radius;
+        int nx = x + (int) round(offset.x), ny = y + (int) round(offset.y);
+        if (nx < 0 || ny < 0 || nx >= current.width || ny >= current.height || (nx == x && ny == y)) {
+            continue;
+        }
+        int neighborIdx = ny * current.width + nx;
+        if (!current.surfaces[neighborIdx].obj || !similar(surface, current.surfaces[neighborIdx])) {
+            continue;
+        }
+        const Reservoir &neighbor = initial[neighborIdx];
+        merged.add(neighbor.sample, target(neighbor.sample) * neighbor.weight * neighbor.count, neighbor.count,
+                   sampler.get1D());
+    }
+    merged.finalize(target(merged.sample));
+    current.reservoirs[pixelIdx] = merged;
+}
+
+void LightResampler::endFrame() {
+    std::swap(history, current);
+    hasHistory = true;
+    frameCount++;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "PinholeCamera.h"
+#include "Sampler.h"
+
+class GameObject;
+class Material;
+struct SceneSnapshot;
+
+// A point on a light, seen directly or through one of its virtual lights
+struct LightSample {
+    int light = -1;
+    // Index into SceneSnapshot::virtualLights[light], -1 if seen directly
+    int virtualLight = -1;
+    // Point on the light relative to its center
+    glm::vec3 offset = glm::vec3(0);
+};
+
+// Weighted reservoir keeping one of the light samples streamed through it
+struct Reservoir {
+    LightSample sample;
+    float weightSum = 0;
+    // Number of candidates the reservoir stands for
+    float count = 0;
+    // The direct light of sample times weight estimates the direct light of
+    // every candidate
+    float weight = 0;
+
+    // Stream in candidate with resampling weight w, standing for count
+    // candidates of its own. u is uniform in [0, 1).
+    void add(const LightSample &candidate, float w, float count, float u);
+    // Compute weight once every candidate is in, target is the target
+    // function at the sample kept
+    void finalize(float target);
+};
+
+// Camera hit the reservoir of a pixel belongs to
+struct ResamplingSurface {
+    // Null if the pixel does not see a shaded surface
+    const GameObject *obj = nullptr;
+    const Material *material = nullptr;
+    glm::vec3 pos, normal, viewDir, texColor;
+    float depth = 0;
+};
+
+// ReSTIR-style direct light for camera hits. Every pixel resamples a few
+// light candidates into a reservoir, merges it with the reservoir of the
+// same surface in the last frame, then with the reservoirs of nearby pixels
+// seeing a similar surface, so its one final shadow ray stands for the
+// candidates of many pixels and frames. Merged reservoirs are weighted by
+// how many candidates they saw, which is slightly biased near edges.
+class LightResampler {
+  public:
+    // Unshadowed direct light of a sample at the pixel being resampled
+    using Target = std::function<float(const LightSample &)>;
+
+    // Start resampling a frame. History is dropped when the lights, the
+    // portals or the resolution change.
+    void beginFrame(const PinholeCamera &camera, int width, int height, const SceneSnapshot &scene,
+                    float depthTolerance, int historyLimit);
+    // Differs for every frame since the history started, to seed samplers
+    uint32_t frame() const { return frameCount; }
+    // Surface a pixel sees and the reservoir of its own candidates
+    void setInitial(int pixelIdx, const ResamplingSurface &surface, const Reservoir &reservoir);
+    // Merge the last frame's reservoir at the same surface into the initial
+    // reservoir of pixelIdx, returns it
+    Reservoir &reuseTemporal(int pixelIdx, const Target &target, Sampler &sampler);
+    // Final reservoir of pixel (x, y) from its initial reservoir and those of
+    // up to numNeighbors pixels within radius
+    void reuseSpatial(int x, int y, int numNeighbors, float radius, const Target &target, Sampler &sampler);
+    const ResamplingSurface &surface(int pixelIdx) const { return current.surfaces[pixelIdx]; }
+    const Reservoir &reservoir(int pixelIdx) const { return current.reservoirs[pixelIdx]; }
+    // The final reservoirs become the history of the next frame
+    void endFrame();
+
+  private:
+    struct Frame {
+        PinholeCamera camera;
+        int width = 0, height = 0;
+        std::vector<ResamplingSurface> surfaces;
+        std::vector<Reservoir> reservoirs;
+    };
+    bool similar(const ResamplingSurface &a, const ResamplingSurface &b) const;
+
+    Frame history, current;
+    std::vector<Reservoir> initial;
+    bool hasHistory = false;
+    std::string key;
+    float depthTolerance = 0;
+    int historyLimit = 0;
+    uint32_t frameCount = 0;
+};
@@ -0,0 +1,138 @@
+#include "PathIntegrator.h"
+#include "RTShading.h"
+#include <algorithm>
+
+using namespace glm;
+using namespace std;
+
+// Sets a pixel's paths draw from: sample i of a set belongs to path i
+enum PathSetSlot { PathBounce, PathRoulette, PathLight0 };
+
+int pathLightSets(const SceneSnapshot &scene) {
+    return useLightTree ? 2 : scene.lights.size();
+}
+
+std::vector<SampleSet> pathSampleSets(Sampler &sampler, int numLights) {
+    int perDepth = PathLight0 + numLights;
+    vector<SampleSet> sets;
+    for (int i = 0; i < (numBounces + 1) * perDepth; i++) {
+        sets.push_back(sampler.startSet());
+    }
+    return sets;
+}
+
+glm::vec3 tracePath(Ray ray, SurfaceInteraction hit, const SceneAccel &accel,
+                    const std::vector<SampleSet> &sets, uint32_t sampleIndex) {
+    SceneSnapshot &scene = accel.scene();
+    int perDepth = PathLight0 + pathLightSets(scene);
+    vec3 color(0), throughput(1);
+    int portalHops = 0;
+    for (int bounceDepth = 0; ; ) {
+        vec3 vert[3] = { hit.vert(0), hit.vert(1), hit.vert(2) };
+        vec3 hitPos = hit.u * vert[1] + hit.v * vert[2] + (1 - hit.u - hit.v) * vert[0];
+        vec3 hitNorm = hit.normal();
+        const SampleSet *depthSets = &sets[bounceDepth * perDepth];
+
+        Material *material = hit.material;
+        if (hit.kind == ObjectKind::Portal && !material) {
+            Portal *portal = static_cast<Portal *>(hit.obj);
+            if (!portal->open || !portal->linkedPortal->open) {
+                if (portal->hasOutline) {
+                    color += throughput * portal->outline->color * 255.f;
+                }
+                break;
+            }
+            if (++portalHops > maxPortalHops) {
+                break;
+            }
+
+            // Same path on the other side, without counting a bounce
+            const mat4 &toLinked = scene.portalTransform(*portal).toLinked;
+            vec3 newEye = vec3(toLinked * vec4(ray.o, 1));
+            vec3 newOrig = vec3(toLinked * vec4(hitPos, 1));
+            Ray portalRay(newOrig, normalize(newOrig - newEye));
+            portalDifferentials(ray, hitPos, hitNorm, toLinked, portalRay);
+            ray = portalRay;
+        }
+        else if (!material) {
+            if (hit.kind == ObjectKind::PortalOutline) {
+                color += throughput * static_cast<PortalOutline *>(hit.obj)->color * 255.f;
+            }
+            else {
+                color += throughput * 255.f;
+            }
+            break;
+        }
+        else {
+            vec3 texColor = surfaceTexColor(ray, hit);
+
+            // One shadow ray per light, soft shadows pick a point on the light.
+            // The light tree picks a single light for the shadow ray instead.
+            if (useLightTree) {
+                LightTreeSample sample;
+                if (sampleLightTree(scene, hitPos, hitNorm, depthSets[PathLight0][sampleIndex].x,
+                                    depthSets[PathLight0 + 1][sampleIndex], bounceDepth, sample)) {
+                    const Light &light = scene.lights[sample.emitter->light];
+                    vec3 lightPos = sample.position;
+                    bool lit = false;
+                    if (!sample.emitter->virtualLight) {
+                        lit = !checkShadow(hitPos, lightPos, accel);
+                    }
+                    else {
+                        lit = !checkShadowThroughPortals(hitPos, sample.position, *sample.emitter->virtualLight, scene, accel,
+                                                         lightPos);
+                    }
+                    if (lit) {
+                        color += throughput * sample.weight *
+                            blinnPhong(material, texColor, hitNorm, normalize(lightPos - hitPos), ray.d, light.intensity);
+                    }
+                }
+            }
+            else {
+                int lightNum = 0;
+                for (const Light &light : scene.lights) {
+                    vec3 lightPos = light.position;
+                    if (softShadows(bounceDepth)) {
+                        lightPos = lightSamplePosition(light, hitPos, depthSets[PathLight0 + lightNum][sampleIndex]);
+                    }
+
+                    if (!checkShadow(hitPos, lightPos, accel)) {
+                        color += throughput * blinnPhong(material, texColor, hitNorm, normalize(lightPos - hitPos), ray.d, light.intensity);
+                    }
+                    // Check for light through portals
+                    for (const VirtualLight &virtualLight : scene.virtualLights[lightNum]) {
+                        vec3 transformedLightPos;
+                        if (!checkShadowThroughPortals(hitPos, lightPos, virtualLight, scene, accel, transformedLightPos)) {
+                            color += throughput * blinnPhong(material, texColor, hitNorm, normalize(transformedLightPos - hitPos),
+                                                             ray.d, light.intensity);
+                        }
+                    }
+                    lightNum++;
+                }
+            }
+
+            if (bounceDepth >= numBounces) {
+                break;
+            }
+            throughput *= texColor / 255.f;
+
+            // Russian roulette
+            if (bounceDepth >= rouletteDepth) {
+                float survive = std::min(0.95f, std::max(throughput.x, std::max(throughput.y, throughput.z)));
+                if (depthSets[PathRoulette][sampleIndex].x >= survive) {
+                    break;
+                }
+                throughput /= survive;
+            }
+
+            ray = Ray(hitPos, sampleHemisphere(hitNorm, depthSets[PathBounce][sampleIndex]));
+            bounceDepth++;
+            portalHops = 0;
+        }
+
+        if (!accel.Intersect(ray, hit)) {
+            break;
+        }
+    }
+    return color;
+}
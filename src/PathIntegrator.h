@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+#include "Sampler.h"
+#include "SceneAccel.h"
+
+// Path integrator. Every sample follows a single path from the camera hit,
+// bouncing up to numBounces times, so the work per pixel grows linearly with
+// the number of bounces. Once rouletteDepth bounces are done, paths that carry
+// little light are ended at random and the survivors weighted up to match.
+
+// Sets the light samples of a path take at every depth, one per light or a
+// pick and a point with the light tree
+int pathLightSets(const SceneSnapshot &scene);
+// Sample sets of a pixel's paths, drawn once so path i takes sample i of each
+std::vector<SampleSet> pathSampleSets(Sampler &sampler, int numLights);
+// Light along path sampleIndex from the camera hit of ray
+glm::vec3 tracePath(Ray ray, SurfaceInteraction hit, const SceneAccel &accel,
+                    const std::vector<SampleSet> &sets, uint32_t sampleIndex);
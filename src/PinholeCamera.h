@@ -0,0 +1,39 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include "Primitive.h"
+
+// Primary rays through the pixel centers of the player's view
+struct PinholeCamera {
+    glm::vec3 eye;
+    // Camera to world rotation, the camera looks down -z
+    glm::mat4 view;
+    float angle, aspect, invWidth, invHeight;
+
+    glm::vec3 direction(float px, float py) const {
+        float xx = (2 * ((px + 0.5) * invWidth) - 1) * angle * aspect;
+        float yy = (1 - 2 * ((py + 0.5) * invHeight)) * angle;
+        return glm::normalize(glm::vec3(view * glm::vec4(xx, yy, -1, 0)));
+    }
+
+    Ray generateRay(int px, int py) const {
+        Ray ray(eye, direction(px, py));
+        ray.hasDifferentials = true;
+        ray.rxOrigin = ray.ryOrigin = eye;
+        ray.rxDirection = direction(px + 1, py);
+        ray.ryDirection = direction(px, py + 1);
+        return ray;
+    }
+
+    // Continuous pixel coordinates of p, false if p is behind the camera
+    bool project(const glm::vec3 &p, glm::vec2 &pixel) const {
+        glm::vec3 local = glm::transpose(glm::mat3(view)) * (p - eye);
+        if (local.z >= 0) {
+            return false;
+        }
+        float xx = local.x / -local.z / (angle * aspect);
+        float yy = local.y / -local.z / angle;
+        pixel = glm::vec2((xx + 1) / (2 * invWidth) - 0.5f, (1 - yy) / (2 * invHeight) - 0.5f);
+        return true;
+    }
+};
@@ -41,6 +41,8 @@ public:
 
     Camera camera;
     Portal *linkedPortal = nullptr;
+    // Slot in the portal transform table of a scene snapshot
+    int index = -1;
     physx::PxActor *surface = nullptr;
     glm::vec3 localForward = glm::vec3(0, 1, 0);
     glm::vec3 localUp = glm::vec3(0, 0, -1);
@@ -0,0 +1,458 @@
+#include "Primitive.h"
+#include "Portal.h"
+#include "PortalOutline.h"
+#include "Wall.h"
+#include "Box.h"
+#include "RTTexture.h"
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <limits>
+
+using namespace glm;
+using namespace std;
+
+#define EPSILON 0.00001
+
+bool SurfaceInteraction::operator<(const SurfaceInteraction &rhs) {
+    if (abs(d - rhs.d) < 0.0001) {
+        if (kind == ObjectKind::Portal) {
+            return true;
+        }
+        else if (rhs.kind == ObjectKind::Portal) {
+            return false;
+        }
+        else if (kind == ObjectKind::PortalOutline) {
+            return true;
+        }
+        else if (rhs.kind == ObjectKind::PortalOutline) {
+            return false;
+        }
+    }
+    return d < rhs.d;
+}
+
+ObjectTag::ObjectTag(GameObject *obj) : obj(obj) {
+    if (!obj) {
+        return;
+    }
+    if (dynamic_cast<Wall *>(obj)) {
+        kind = ObjectKind::Wall;
+    }
+    else if (dynamic_cast<Box *>(obj)) {
+        kind = ObjectKind::Box;
+    }
+    else if (dynamic_cast<Portal *>(obj)) {
+        kind = ObjectKind::Portal;
+    }
+    else if (dynamic_cast<PortalOutline *>(obj)) {
+        kind = ObjectKind::PortalOutline;
+    }
+    material = obj->getMaterial();
+}
+
+std::vector<ShadingRecord> bakeShading(const ObjectTag &object, const glm::mat4 &objectToWorld) {
+    Shape *model = object.obj->getModel();
+    const RTTexture *texture = object.material ? RTTexture::get(object.material->getTexture()) : nullptr;
+    int nFaces = model->eleBuf.size() / 3;
+    std::vector<ShadingRecord> records(nFaces);
+    for (int fIdx = 0; fIdx < nFaces; fIdx++) {
+        ShadingRecord &record = records[fIdx];
+        vec3 verts[3], vn(0);
+        for (int vNum = 0; vNum < 3; vNum++) {
+            unsigned int vIdx = model->eleBuf[fIdx*3+vNum];
+            vec3 p;
+            for (int i = 0; i < 3; i++) {
+                p[i] = model->posBuf[vIdx*3+i];
+            }
+            verts[vNum] = vec3(objectToWorld * vec4(p, 1));
+            // Models without normals or texture coordinates are only ever
+            // shaded through their geometry
+            if (vNum == 0 && !model->norBuf.empty()) {
+                for (int i = 0; i < 3; i++) {
+                    vn[i] = model->norBuf[vIdx*3+i];
+                }
+            }
+            for (int i = 0; i < 2 && !model->texBuf.empty(); i++) {
+                record.uv[vNum][i] = model->texBuf[vIdx*2+i];
+            }
+        }
+        record.normal = normalize(cross(verts[1] - verts[0], verts[2] - verts[0]));
+        record.texture = texture;
+
+        // scale UV for Wall objects
+        if (object.kind == ObjectKind::Wall) {
+            Wall *wall = static_cast<Wall *>(object.obj);
+            vec2 scale(1);
+            if (dot(vn, vec3(1, 0, 0)) != 0) {
+                scale = vec2(wall->size.y, wall->size.z);
+            } else if (dot(vn, vec3(0, 1, 0)) != 0) {
+                scale = vec2(wall->size.x, wall->size.z);
+            } else if (dot(vn, vec3(0, 0, 1)) != 0) {
+                scale = vec2(wall->size.y, wall->size.x);
+            }
+            for (int vNum = 0; vNum < 3; vNum++) {
+                record.uv[vNum] *= scale;
+            }
+        }
+    }
+    return records;
+}
+
+void SurfaceInteraction::setObject(const ObjectTag &tag) {
+    obj = tag.obj;
+    kind = tag.kind;
+    material = tag.material;
+}
+
+glm::vec3 SurfaceInteraction::vert(int i) const {
+    vec3 p = tris->vert(triIndex, i);
+    if (!objectToWorld) {
+        return p;
+    }
+    return vec3(*objectToWorld * vec4(p, 1));
+}
+
+glm::vec3 SurfaceInteraction::normal() const {
+    if (shading) {
+        return shading->normal;
+    }
+    vec3 v0 = vert(0);
+    return normalize(cross(vert(1) - v0, vert(2) - v0));
+}
+
+Ray::Ray() : tMax(INFINITY) {
+
+}
+
+Ray::Ray(glm::vec3 o, glm::vec3 d) : o(o), d(d), tMax(INFINITY) {
+
+}
+
+Ray::Ray(glm::vec3 o, glm::vec3 d, float tMax) : o(o), d(d), tMax(tMax) {
+
+}
+
+RayPacket::RayPacket(const Ray *rays, int count) : active((1 << count) - 1) {
+    float lanes[7][Size];
+    for (int lane = 0; lane < Size; lane++) {
+        // Pad unused lanes with a copy of the last ray so they stay well-defined
+        const Ray &r = rays[std::min(lane, count - 1)];
+        for (int i = 0; i < 3; i++) {
+            lanes[i][lane] = r.o[i];
+            lanes[3 + i][lane] = r.d[i];
+        }
+        lanes[6][lane] = r.tMax;
+    }
+    for (int i = 0; i < 3; i++) {
+        o[i] = float4::load(lanes[i]);
+        d[i] = float4::load(lanes[3 + i]);
+        invDir[i] = float4(1.f) / d[i];
+    }
+    tMax = float4::load(lanes[6]);
+}
+
+Ray RayPacket::ray(int lane) const {
+    return Ray(vec3(o[0][lane], o[1][lane], o[2][lane]),
+               vec3(d[0][lane], d[1][lane], d[2][lane]), tMax[lane]);
+}
+
+bool Bounds3f::IntersectP(const Ray &ray, float *hitt0, float *hitt1) const {
+    float t0 = 0, t1 = ray.tMax;
+    for (int i = 0; i < 3; ++i) {
+        float invRayDir = 1 / ray.d[i];
+        float tNear = (pMin[i] - ray.o[i]) * invRayDir;
+        float tFar  = (pMax[i] - ray.o[i]) * invRayDir;
+        if (tNear > tFar) std::swap(tNear, tFar);
+        tFar *= 1 + 2 * tgamma(3);
+
+        t0 = tNear > t0 ? tNear : t0;
+        t1 = tFar  < t1 ? tFar  : t1;
+        if (t0 > t1) return false;
+
+    }
+    if (hitt0) *hitt0 = t0;
+    if (hitt1) *hitt1 = t1;
+    return true;
+}
+
+static constexpr float MachineEpsilon = std::numeric_limits<float>::epsilon() * 0.5f;
+static constexpr float gamma3 = (3 * MachineEpsilon) / (1 - 3 * MachineEpsilon);
+
+bool Bounds3f::IntersectP(const Ray &ray, float tMax, const glm::vec3 &invDir, const int dirIsNeg[3]) const {
+    const vec3 *b[2] = { &pMin, &pMax };
+    // Check for ray intersection against $x$ and $y$ slabs
+    float tMin = ((*b[dirIsNeg[0]]).x - ray.o.x) * invDir.x;
+    float tMaxX = ((*b[1 - dirIsNeg[0]]).x - ray.o.x) * invDir.x;
+    float tyMin = ((*b[dirIsNeg[1]]).y - ray.o.y) * invDir.y;
+    float tyMax = ((*b[1 - dirIsNeg[1]]).y - ray.o.y) * invDir.y;
+
+    // Update _tMaxX_ and _tyMax_ to ensure robust bounds intersection
+    tMaxX *= 1 + 2 * gamma3;
+    tyMax *= 1 + 2 * gamma3;
+    if (tMin > tyMax || tyMin > tMaxX) return false;
+    if (tyMin > tMin) tMin = tyMin;
+    if (tyMax < tMaxX) tMaxX = tyMax;
+
+    // Check for ray intersection against $z$ slab
+    float tzMin = ((*b[dirIsNeg[2]]).z - ray.o.z) * invDir.z;
+    float tzMax = ((*b[1 - dirIsNeg[2]]).z - ray.o.z) * invDir.z;
+
+    // Update _tzMax_ to ensure robust bounds intersection
+    tzMax *= 1 + 2 * gamma3;
+    if (tMin > tzMax || tzMin > tMaxX) return false;
+    if (tzMin > tMin) tMin = tzMin;
+    if (tzMax < tMaxX) tMaxX = tzMax;
+    return (tMin < tMax) && (tMaxX > 0);
+}
+
+int Bounds3f::IntersectP(const RayPacket &packet, float4 *hitt0, float4 *hitt1) const {
+    return IntersectP(packet, packet.tMax, packet.active, hitt0, hitt1);
+}
+
+int Bounds3f::IntersectP(const RayPacket &packet, const float4 &tMax, int active, float4 *hitt0, float4 *hitt1) const {
+    float4 t0(0.f), t1 = tMax;
+    for (int i = 0; i < 3; ++i) {
+        float4 tNear = (float4(pMin[i]) - packet.o[i]) * packet.invDir[i];
+        float4 tFar  = (float4(pMax[i]) - packet.o[i]) * packet.invDir[i];
+        float4 swap = tNear > tFar;
+        float4 n = select(swap, tFar, tNear);
+        tFar = select(swap, tNear, tFar) * float4(1 + 2 * tgamma(3));
+
+        t0 = max(n, t0);
+        t1 = min(tFar, t1);
+    }
+    if (hitt0) *hitt0 = t0;
+    if (hitt1) *hitt1 = t1;
+    return ~movemask(t0 > t1) & active;
+}
+
+Bounds3f::Bounds3f() : pMin(INFINITY), pMax(-INFINITY) {
+
+}
+
+void Bounds3f::extend(const Bounds3f &other) {
+    pMin = glm::min(pMin, other.pMin);
+    pMax = glm::max(pMax, other.pMax);
+}
+
+void Bounds3f::extend(const glm::vec3 &p) {
+    pMin = glm::min(pMin, p);
+    pMax = glm::max(pMax, p);
+}
+
+glm::vec3 Bounds3f::Offset(const glm::vec3 &p) const {
+    vec3 o = p - pMin;
+    for (int i = 0; i < 3; i++) {
+        if (pMax[i] > pMin[i]) o[i] /= pMax[i] - pMin[i];
+    }
+    return o;
+}
+
+int Bounds3f::MaximumExtent() const {
+    glm::vec3 d = pMax - pMin;
+    if (d.x > d.y && d.x > d.z)
+        return 0;
+    else if (d.y > d.z)
+        return 1;
+    else
+        return 2;
+}
+
+Bounds3f Bounds3f::Transform(const glm::mat4 &m) const {
+    Bounds3f b;
+    for (int corner = 0; corner < 8; corner++) {
+        vec3 p((corner & 1) ? pMax.x : pMin.x,
+               (corner & 2) ? pMax.y : pMin.y,
+               (corner & 4) ? pMax.z : pMin.z);
+        b.extend(vec3(m * vec4(p, 1)));
+    }
+    return b;
+}
+
+float Bounds3f::SurfaceArea() const {
+    vec3 d = pMax - pMin;
+    return 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
+}
+
+const ObjectTag TriangleStore::noObject;
+
+void TriangleStore::reserve(int n) {
+    tris.reserve(n);
+    objIds.reserve(n);
+    faceIndices.reserve(n);
+}
+
+void TriangleStore::add(const glm::vec3 verts[3], GameObject *obj, int faceIndex) {
+    tris.push_back({ verts[0], verts[1] - verts[0], verts[2] - verts[0] });
+    if (!obj) {
+        objIds.push_back(-1);
+    }
+    else {
+        // Triangles of the same object are added together
+        if (objects.empty() || objects.back().obj != obj) {
+            objects.push_back(ObjectTag(obj));
+        }
+        objIds.push_back((int)objects.size() - 1);
+    }
+    faceIndices.push_back(faceIndex);
+}
+
+void TriangleStore::reorder(const std::vector<int> &order) {
+    std::vector<Triangle> newTris;
+    std::vector<int> newObjIds, newFaceIndices;
+    newTris.reserve(order.size());
+    newObjIds.reserve(order.size());
+    newFaceIndices.reserve(order.size());
+    for (int i : order) {
+        newTris.push_back(tris[i]);
+        newObjIds.push_back(objIds[i]);
+        newFaceIndices.push_back(faceIndices[i]);
+    }
+    tris.swap(newTris);
+    objIds.swap(newObjIds);
+    faceIndices.swap(newFaceIndices);
+}
+
+glm::vec3 TriangleStore::vert(int i, int corner) const {
+    const Triangle &t = tris[i];
+    if (corner == 0) {
+        return t.v0;
+    }
+    return t.v0 + (corner == 1 ? t.e1 : t.e2);
+}
+
+Bounds3f TriangleStore::WorldBound(int i) const {
+    const Triangle &t = tris[i];
+    vec3 v1 = t.v0 + t.e1, v2 = t.v0 + t.e2;
+    Bounds3f b;
+    b.pMin = glm::min(t.v0, glm::min(v1, v2));
+    b.pMax = glm::max(t.v0, glm::max(v1, v2));
+    return b;
+}
+
+
+// https://cadxfem.org/inf/Fast%20MinimumStorage%20RayTriangle%20Intersection.pdf
+bool TriangleStore::Intersect(int i, const Ray &r, SurfaceInteraction &si) const {
+    const Triangle &t = tris[i];
+    vec3 pvec = cross(r.d, t.e2);
+    float det = dot(t.e1, pvec);
+
+    if (det < EPSILON) {
+        return false;
+    }
+
+    vec3 tvec = r.o - t.v0;
+    si.u = dot(tvec, pvec);
+    if (si.u < 0 || si.u > det) {
+        return false;
+    }
+
+    vec3 qvec = cross(tvec, t.e1);
+    si.v = dot(r.d, qvec);
+    if (si.v < 0 || si.u + si.v > det) {
+        return false;
+    }
+
+    si.d = dot(t.e2, qvec);
+    float inv_det = 1 / det;
+    si.d *= inv_det;
+    si.u *= inv_det;
+    si.v *= inv_det;
+    si.tris = this;
+    si.triIndex = i;
+    si.setObject(object(i));
+    si.faceIndex = faceIndices[i];
+
+    return si.d > -EPSILON;
+}
+
+bool TriangleStore::IntersectP(int i, const Ray &r) const {
+    SurfaceInteraction si;
+    return Intersect(i, r, si) && si.d <= r.tMax;
+}
+
+int TriangleStore::Intersect(int i, const RayPacket &r, int active, SurfaceInteraction si[RayPacket::Size]) const {
+    const Triangle &t = tris[i];
+    float4 e1[3] = { float4(t.e1.x), float4(t.e1.y), float4(t.e1.z) };
+    float4 e2[3] = { float4(t.e2.x), float4(t.e2.y), float4(t.e2.z) };
+
+    float4 pvec[3] = {
+        r.d[1] * e2[2] - e2[1] * r.d[2],
+        r.d[2] * e2[0] - e2[2] * r.d[0],
+        r.d[0] * e2[1] - e2[0] * r.d[1]
+    };
+    float4 det = e1[0] * pvec[0] + e1[1] * pvec[1] + e1[2] * pvec[2];
+
+    float4 tvec[3] = {
+        r.o[0] - float4(t.v0.x),
+        r.o[1] - float4(t.v0.y),
+        r.o[2] - float4(t.v0.z)
+    };
+    float4 u = tvec[0] * pvec[0] + tvec[1] * pvec[1] + tvec[2] * pvec[2];
+
+    float4 qvec[3] = {
+        tvec[1] * e1[2] - e1[1] * tvec[2],
+        tvec[2] * e1[0] - e1[2] * tvec[0],
+        tvec[0] * e1[1] - e1[0] * tvec[1]
+    };
+    float4 v = r.d[0] * qvec[0] + r.d[1] * qvec[1] + r.d[2] * qvec[2];
+
+    float4 zero(0.f);
+    int hits = active & movemask((det >= float4(EPSILON)) & (u >= zero) & (u <= det) &
+                                 (v >= zero) & (u + v <= det));
+    if (!hits) {
+        return 0;
+    }
+
+    float4 invDet = float4(1.f) / det;
+    float4 dist = (e2[0] * qvec[0] + e2[1] * qvec[1] + e2[2] * qvec[2]) * invDet;
+    hits &= movemask(dist > float4(-EPSILON));
+
+    float ts[RayPacket::Size], us[RayPacket::Size], vs[RayPacket::Size];
+    dist.store(ts);
+    (u * invDet).store(us);
+    (v * invDet).store(vs);
+    for (int lane = 0; lane < RayPacket::Size; lane++) {
+        if (hits & (1 << lane)) {
+            si[lane].d = ts[lane];
+            si[lane].u = us[lane];
+            si[lane].v = vs[lane];
+            si[lane].tris = this;
+            si[lane].triIndex = i;
+            si[lane].setObject(object(i));
+            si[lane].faceIndex = faceIndices[i];
+        }
+    }
+    return hits;
+}
+
+int TriangleStore::IntersectP(int i, const RayPacket &r, int active) const {
+    SurfaceInteraction si[RayPacket::Size];
+    int hits = Intersect(i, r, active, si);
+    for (int lane = 0; lane < RayPacket::Size; lane++) {
+        if ((hits & (1 << lane)) && si[lane].d > r.tMax[lane]) {
+            hits &= ~(1 << lane);
+        }
+    }
+    return hits;
+}
+
+TriangleStore shapeToTriangles(Shape *shape) {
+    TriangleStore tris;
+    int nFaces = shape->eleBuf.size() / 3;
+    tris.reserve(nFaces);
+
+    // loop over each face
+    for (int fIdx = 0; fIdx < nFaces; fIdx++) {
+        vec3 verts[3];
+        for (int vNum = 0; vNum < 3; vNum++) {
+            unsigned int vIdx = shape->eleBuf[fIdx*3+vNum];
+            for (int i = 0; i < 3; i++) {
+                verts[vNum][i] = shape->posBuf[vIdx*3+i];
+            }
+        }
+        tris.add(verts, nullptr, fIdx);
+    }
+
+    return tris;
+}
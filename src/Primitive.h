@@ -0,0 +1,151 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <glm/glm.hpp>
+#include "GameObject.h"
+#include "SIMD.h"
+
+class RTTexture;
+
+struct Ray {
+    Ray();
+    Ray(glm::vec3 o, glm::vec3 d);
+    Ray(glm::vec3 o, glm::vec3 d, float tMax);
+    glm::vec3 o, d;
+    float tMax;
+    // Rays through the neighbouring pixels in x and y, only set on camera
+    // rays and the rays continuing them through portals. Used to pick the
+    // texture level.
+    bool hasDifferentials = false;
+    glm::vec3 rxOrigin, ryOrigin, rxDirection, ryDirection;
+};
+
+// Bundle of coherent rays traced through the accelerator together. Lanes past
+// the number of rays passed in are inactive.
+struct RayPacket {
+    static const int Size = 4;
+    RayPacket(const Ray *rays, int count);
+    Ray ray(int lane) const;
+    float4 o[3], d[3], invDir[3];
+    float4 tMax;
+    int active;
+};
+
+struct Bounds3f {
+public:
+    Bounds3f();
+    Bounds3f(const glm::vec3 &pMin, const glm::vec3 &pMax) : pMin(pMin), pMax(pMax) {}
+    void extend(const Bounds3f &other);
+    void extend(const glm::vec3 &p);
+    float SurfaceArea() const;
+    int MaximumExtent() const;
+    glm::vec3 Centroid() const { return 0.5f * (pMin + pMax); }
+    // Position of p relative to the corners, 0 at pMin and 1 at pMax
+    glm::vec3 Offset(const glm::vec3 &p) const;
+    bool IntersectP(const Ray &ray, float *hitt0, float *hitt1) const;
+    // Slab test with precomputed reciprocal direction, for BVH traversal
+    bool IntersectP(const Ray &ray, float tMax, const glm::vec3 &invDir, const int dirIsNeg[3]) const;
+    int IntersectP(const RayPacket &packet, float4 *hitt0, float4 *hitt1) const;
+    int IntersectP(const RayPacket &packet, const float4 &tMax, int active, float4 *hitt0, float4 *hitt1) const;
+    Bounds3f Transform(const glm::mat4 &m) const;
+    glm::vec3 pMin, pMax;
+};
+
+// Hits this close to the current closest hit may still win the portal
+// tie-break in SurfaceInteraction::operator<, so traversal keeps visiting them
+#define TIE_EPSILON 0.0001f
+
+// Kind of game object a primitive belongs to, so the tie-break and shading
+// dispatch compare an integer instead of running dynamic_cast on every hit
+enum class ObjectKind : uint8_t {
+    Other,
+    Wall,
+    Box,
+    Portal,
+    PortalOutline
+};
+
+// Game object of a primitive along with its kind and material, resolved once
+// when the accelerator is built
+struct ObjectTag {
+    ObjectTag() {}
+    explicit ObjectTag(GameObject *obj);
+    GameObject *obj = nullptr;
+    ObjectKind kind = ObjectKind::Other;
+    Material *material = nullptr;
+};
+
+// Everything shading needs from a triangle of a placed object, baked when the
+// scene accelerator is built so a hit reads one cache line instead of going
+// through the model buffers and the managers
+struct alignas(64) ShadingRecord {
+    // World space face normal
+    glm::vec3 normal;
+    // Texture coordinates of the corners, with the wall scaling applied
+    glm::vec2 uv[3];
+    const RTTexture *texture;
+};
+
+// Shading records of every face of an object's model, indexed by face
+std::vector<ShadingRecord> bakeShading(const ObjectTag &object, const glm::mat4 &objectToWorld);
+
+class TriangleStore;
+struct SurfaceInteraction {
+    float d;
+    float u, v;
+    // Triangle that was hit, in the object space of its mesh
+    const TriangleStore *tris;
+    int triIndex;
+    GameObject *obj;
+    ObjectKind kind;
+    Material *material;
+    int faceIndex;
+    // Transform of the mesh instance that was hit, null if tris is in world space
+    const glm::mat4 *objectToWorld = nullptr;
+    // Baked shading of the face that was hit, null outside the scene accelerator
+    const ShadingRecord *shading = nullptr;
+    // World space corner of the triangle that was hit
+    glm::vec3 vert(int i) const;
+    // World space face normal
+    glm::vec3 normal() const;
+    void setObject(const ObjectTag &tag);
+    bool operator<(const SurfaceInteraction &rhs);
+    bool operator>(const SurfaceInteraction &rhs) { return !operator<(rhs); }
+};
+
+// Triangles of an aggregate packed by index. The first vertex and the two
+// edges every intersection test reads are stored together, the ids that are
+// only needed once a triangle is hit live in arrays of their own.
+class TriangleStore {
+public:
+    struct Triangle {
+        glm::vec3 v0, e1, e2;
+    };
+    int size() const { return (int)tris.size(); }
+    void reserve(int n);
+    void add(const glm::vec3 verts[3], GameObject *obj, int faceIndex);
+    // Permute the triangles so that triangle i is the old triangle order[i]
+    void reorder(const std::vector<int> &order);
+    glm::vec3 vert(int i, int corner) const;
+    const ObjectTag &object(int i) const { return objIds[i] < 0 ? noObject : objects[objIds[i]]; }
+    int faceIndex(int i) const { return faceIndices[i]; }
+    Bounds3f WorldBound(int i) const;
+    bool Intersect(int i, const Ray &r, SurfaceInteraction &si) const;
+    bool IntersectP(int i, const Ray &r) const;
+    // Packet versions return a bitmask of the lanes that hit
+    int Intersect(int i, const RayPacket &r, int active, SurfaceInteraction si[RayPacket::Size]) const;
+    int IntersectP(int i, const RayPacket &r, int active) const;
+
+private:
+    std::vector<Triangle> tris;
+    // Index into objects, -1 for object space triangles
+    std::vector<int> objIds;
+    std::vector<int> faceIndices;
+    std::vector<ObjectTag> objects;
+    static const ObjectTag noObject;
+};
+
+// Object space triangles of a mesh, shared by every object using it
+TriangleStore shapeToTriangles(Shape *shape);
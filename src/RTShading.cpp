@@ -0,0 +1,167 @@
+#include "RTShading.h"
+#include "Material.h"
+#include "RTTexture.h"
+#include <algorithm>
+#define GLM_ENABLE_EXPERIMENTAL
+#include <glm/gtx/intersect.hpp>
+
+using namespace glm;
+using namespace std;
+
+bool fastCheckPortal(const glm::vec3 &orig, const glm::vec3 &dir, Portal &portal) {
+    float d;
+    if (glm::intersectRayPlane(orig, dir, portal.position, portal.getForward(), d)) {
+        vec3 hitPos = orig + dir * d;
+        return portal.pointInSideBounds(hitPos);
+    }
+    return false;
+}
+
+bool checkShadow(const glm::vec3 pos, const glm::vec3 lightPos, const Aggregate &accel) {
+    Ray shadowRay(pos, normalize(lightPos - pos), distance(lightPos, pos));
+    return accel.IntersectP(shadowRay);
+}
+
+int checkShadowPacket(const glm::vec3 &pos, const glm::vec3 *lightPos, int count, const Aggregate &accel) {
+    Ray shadowRays[RayPacket::Size];
+    for (int i = 0; i < count; i++) {
+        shadowRays[i] = Ray(pos, normalize(lightPos[i] - pos), distance(lightPos[i], pos));
+    }
+    return accel.IntersectP(RayPacket(shadowRays, count));
+}
+
+bool checkShadowThroughPortals(const glm::vec3 &pos, const glm::vec3 &lightPos, const VirtualLight &virtualLight,
+                               const SceneSnapshot &scene, const Aggregate &accel, glm::vec3 &virtualLightPos) {
+    Portal &first = *virtualLight.portals[0];
+    if (!first.facing(pos) || !virtualLight.portals[virtualLight.depth - 1]->linkedPortal->facing(lightPos)) {
+        return true;
+    }
+
+    virtualLightPos = vec3(virtualLight.toVirtual[0] * vec4(lightPos, 1));
+    vec3 orig = pos;
+    for (int i = 0; i < virtualLight.depth; i++) {
+        Portal &portal = *virtualLight.portals[i];
+        vec3 target = i == 0 ? virtualLightPos : vec3(virtualLight.toVirtual[i] * vec4(lightPos, 1));
+        vec3 lightDir = normalize(target - orig);
+        SurfaceInteraction shadowRayHit;
+        if (!fastCheckPortal(orig, lightDir, portal)
+                || !accel.Intersect(Ray(orig, lightDir), shadowRayHit)
+                || shadowRayHit.obj != &portal) {
+            return true;
+        }
+        vec3 vert2[3] = { shadowRayHit.vert(0), shadowRayHit.vert(1), shadowRayHit.vert(2) };
+        vec3 shadowHitPos = shadowRayHit.u * vert2[1] + shadowRayHit.v * vert2[2] + (1 - shadowRayHit.u - shadowRayHit.v) * vert2[0];
+        orig = vec3(scene.portalTransform(portal).toLinked * vec4(shadowHitPos, 1));
+    }
+    return checkShadow(orig, lightPos, accel);
+}
+
+// Where the ray's x and y differentials cross the plane through p with
+// normal n, false if they run parallel to it
+bool differentialHits(const Ray &ray, const glm::vec3 &p, const glm::vec3 &n, glm::vec3 &px, glm::vec3 &py) {
+    if (!ray.hasDifferentials) {
+        return false;
+    }
+    float dx = dot(n, ray.rxDirection), dy = dot(n, ray.ryDirection);
+    if (dx == 0 || dy == 0) {
+        return false;
+    }
+    px = ray.rxOrigin + ray.rxDirection * (dot(n, p - ray.rxOrigin) / dx);
+    py = ray.ryOrigin + ray.ryDirection * (dot(n, p - ray.ryOrigin) / dy);
+    return true;
+}
+
+glm::vec3 surfaceTexColor(const Ray &ray, const SurfaceInteraction &hit) {
+    const ShadingRecord &shading = *hit.shading;
+    const RTTexture *texture = shading.texture;
+    vec2 uv = hit.u * shading.uv[1] + hit.v * shading.uv[2] + (1 - hit.u - hit.v) * shading.uv[0];
+
+    float level = 0;
+    if (ray.hasDifferentials) {
+        vec3 vert[3] = { hit.vert(0), hit.vert(1), hit.vert(2) };
+        vec3 hitPos = hit.u * vert[1] + hit.v * vert[2] + (1 - hit.u - hit.v) * vert[0];
+        vec3 px, py;
+        if (differentialHits(ray, hitPos, shading.normal, px, py)) {
+            // Change in texture coordinates for an offset in the triangle's plane
+            vec3 e1 = vert[1] - vert[0], e2 = vert[2] - vert[0];
+            float d11 = dot(e1, e1), d12 = dot(e1, e2), d22 = dot(e2, e2);
+            float invDenom = 1 / (d11 * d22 - d12 * d12);
+            auto uvOffset = [&](const vec3 &offset) {
+                float b1 = (d22 * dot(offset, e1) - d12 * dot(offset, e2)) * invDenom;
+                float b2 = (d11 * dot(offset, e2) - d12 * dot(offset, e1)) * invDenom;
+                return b1 * (shading.uv[1] - shading.uv[0]) + b2 * (shading.uv[2] - shading.uv[0]);
+            };
+            level = texture->levelOf(uvOffset(px - hitPos), uvOffset(py - hitPos));
+        }
+    }
+    return texture->lookup(uv, level);
+}
+
+void portalDifferentials(const Ray &ray, const glm::vec3 &hitPos, const glm::vec3 &normal, const glm::mat4 &toLinked,
+                         Ray &portalRay) {
+    vec3 px, py;
+    if (!differentialHits(ray, hitPos, normal, px, py)) {
+        return;
+    }
+    portalRay.hasDifferentials = true;
+    portalRay.rxOrigin = vec3(toLinked * vec4(px, 1));
+    portalRay.ryOrigin = vec3(toLinked * vec4(py, 1));
+    portalRay.rxDirection = vec3(toLinked * vec4(ray.rxDirection, 0));
+    portalRay.ryDirection = vec3(toLinked * vec4(ray.ryDirection, 0));
+}
+
+glm::vec3 lightSamplePosition(const Light &light, const glm::vec3 &hitPos, const glm::vec2 &u) {
+    vec3 lightForward = normalize(hitPos - light.position);
+    vec3 lightRight = cross(vec3(0, 1, 0), lightForward);
+    vec3 lightUp = cross(lightForward, lightRight);
+    vec2 offset = (u - 0.5f) * (float) lightRadius;
+    return light.position + lightRight * offset.x + lightUp * offset.y;
+}
+
+bool softShadows(int bounceDepth) {
+    return bounceDepth == 0 && numShadowSamplesX * numShadowSamplesY > 1;
+}
+
+void lightSamplePositions(const Light &light, const glm::vec3 &hitPos, Sampler &sampler, int bounceDepth,
+                          std::vector<glm::vec3> &positions) {
+    positions.clear();
+    if (!softShadows(bounceDepth)) {
+        positions.push_back(light.position);
+        return;
+    }
+
+    // Sample points spread over the light's square
+    SampleSet lightSet = sampler.startSet();
+    for (int i = 0; i < numShadowSamplesX * numShadowSamplesY; i++) {
+        positions.push_back(lightSamplePosition(light, hitPos, lightSet[i]));
+    }
+}
+
+float lightSampleWeight(int bounceDepth) {
+    return bounceDepth == 0 ? 1.f / (numShadowSamplesX * numShadowSamplesY) : 1.f;
+}
+
+glm::vec3 blinnPhong(const Material *material, const glm::vec3 &texColor, const glm::vec3 &normal,
+                     const glm::vec3 &lightDir, const glm::vec3 &rayDir, const glm::vec3 &intensity) {
+    vec3 diffuse = material->dif * texColor * std::max(0.f, dot(normal, lightDir)) * intensity;
+    vec3 H = normalize((lightDir - rayDir) / 2.f);
+    vec3 specular = material->spec * std::pow(std::max(0.f, dot(H, normal)), material->shine) * intensity * 255.f;
+    return diffuse + specular;
+}
+
+int bounceRayCount(int bounceDepth) {
+    return (int) ceil(numBounceRays / pow(2, bounceDepth));
+}
+
+bool sampleLightTree(const SceneSnapshot &scene, const glm::vec3 &hitPos, const glm::vec3 &hitNorm, float uPick,
+                     const glm::vec2 &uLight, int bounceDepth, LightTreeSample &sample) {
+    float pdf;
+    sample.emitter = scene.lightTree.sample(hitPos, hitNorm, uPick, pdf);
+    if (!sample.emitter) {
+        return false;
+    }
+    const Light &light = scene.lights[sample.emitter->light];
+    sample.position = softShadows(bounceDepth) ? lightSamplePosition(light, hitPos, uLight) : light.position;
+    sample.weight = 1 / pdf;
+    return true;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "Denoiser.h"
+#include "Sampler.h"
+#include "SceneSnapshot.h"
+
+// [raytracing] settings, set by loadRTSettings
+extern int numBounces;
+extern int numBounceRays;
+extern int lightRadius;
+extern int portalLightDepth;
+extern bool useLightTree;
+extern int numShadowSamplesX;
+extern int numShadowSamplesY;
+extern SampleSequence sampleSequence;
+extern int sampleSeed;
+extern bool adaptiveSampling;
+extern int minPasses;
+extern int maxPasses;
+extern float adaptiveThreshold;
+extern int pathSamples;
+extern int rouletteDepth;
+extern float fov;
+extern std::string integrator;
+extern std::string accelType;
+extern bool verbose;
+extern bool useIrradianceCache;
+extern float irradianceCacheError, irradianceCacheMinRadius, irradianceCacheMaxRadius;
+extern bool useDenoiser;
+extern DenoiseSettings denoiseSettings;
+extern bool useTemporalCache;
+extern float temporalDepthTolerance;
+extern int temporalMaxAge;
+extern bool useRestir;
+extern int restirCandidates;
+extern int restirSpatialSamples;
+extern float restirSpatialRadius;
+extern int restirHistory;
+
+// Portal hops allowed between two bounces, stops portals facing each other
+// from trapping a path
+const int maxPortalHops = 32;
+
+bool fastCheckPortal(const glm::vec3 &orig, const glm::vec3 &dir, Portal &portal);
+bool checkShadow(const glm::vec3 pos, const glm::vec3 lightPos, const Aggregate &accel);
+// Shadow test for several light samples seen from the same point, traced as
+// one packet. Returns a bitmask of the occluded samples.
+int checkShadowPacket(const glm::vec3 &pos, const glm::vec3 *lightPos, int count, const Aggregate &accel);
+// Shadow test for a point on a light seen through the portals of
+// virtualLight. Every leg has to reach the next portal before the last one
+// goes on to the light.
+bool checkShadowThroughPortals(const glm::vec3 &pos, const glm::vec3 &lightPos, const VirtualLight &virtualLight,
+                               const SceneSnapshot &scene, const Aggregate &accel, glm::vec3 &virtualLightPos);
+
+// Texture color of a hit on an object with a material, filtered over the
+// footprint of the pixel when the ray has differentials
+glm::vec3 surfaceTexColor(const Ray &ray, const SurfaceInteraction &hit);
+// Differentials of a ray continuing ray through a portal it hit at hitPos
+void portalDifferentials(const Ray &ray, const glm::vec3 &hitPos, const glm::vec3 &normal, const glm::mat4 &toLinked,
+                         Ray &portalRay);
+
+// Point u of the light's square as seen from hitPos
+glm::vec3 lightSamplePosition(const Light &light, const glm::vec3 &hitPos, const glm::vec2 &u);
+// Soft shadows are only used for camera hits
+bool softShadows(int bounceDepth);
+// Points on the light used to shade a hit, every point then stands for
+// lightSampleWeight(bounceDepth) of the light
+void lightSamplePositions(const Light &light, const glm::vec3 &hitPos, Sampler &sampler, int bounceDepth,
+                          std::vector<glm::vec3> &positions);
+float lightSampleWeight(int bounceDepth);
+// Blinn-Phong shading
+glm::vec3 blinnPhong(const Material *material, const glm::vec3 &texColor, const glm::vec3 &normal,
+                     const glm::vec3 &lightDir, const glm::vec3 &rayDir, const glm::vec3 &intensity);
+int bounceRayCount(int bounceDepth);
+
+// A point on a light picked by the light tree, weighted by the inverse of
+// the chance of picking it
+struct LightTreeSample {
+    const LightEmitter *emitter;
+    glm::vec3 position;
+    float weight;
+};
+
+bool sampleLightTree(const SceneSnapshot &scene, const glm::vec3 &hitPos, const glm::vec3 &hitNorm, float uPick,
+                     const glm::vec2 &uLight, int bounceDepth, LightTreeSample &sample);
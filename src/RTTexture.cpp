@@ -0,0 +1,126 @@
+#include "RTTexture.h"
+#include "Texture.h"
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+using namespace glm;
+using namespace std;
+
+const uint8_t *RTTexture::Level::texel(int x, int y) const {
+    int tile = (y / TileSize) * tilesX + x / TileSize;
+    return &texels[(tile * TileSize * TileSize + (y % TileSize) * TileSize + x % TileSize) * 4];
+}
+
+uint8_t *RTTexture::Level::texel(int x, int y) {
+    return const_cast<uint8_t *>(static_cast<const Level *>(this)->texel(x, y));
+}
+
+RTTexture::RTTexture(const Texture &texture) {
+    // Rows are padded out to whole tiles
+    auto allocLevel = [](int width, int height) {
+        Level level;
+        level.width = width;
+        level.height = height;
+        level.tilesX = (width + TileSize - 1) / TileSize;
+        int tilesY = (height + TileSize - 1) / TileSize;
+        level.texels.resize(level.tilesX * tilesY * TileSize * TileSize * 4);
+        return level;
+    };
+
+    int comps = texture.getComponents();
+    Level base = allocLevel(std::max(1, texture.width), std::max(1, texture.height));
+    for (int y = 0; y < base.height && texture.data; y++) {
+        for (int x = 0; x < base.width; x++) {
+            const unsigned char *src = &texture.data[(y * texture.width + x) * comps];
+            uint8_t *dst = base.texel(x, y);
+            if (comps < 3) {
+                // Grey, with alpha in the second channel if there is one
+                dst[0] = dst[1] = dst[2] = src[0];
+                dst[3] = comps == 2 ? src[1] : 255;
+            }
+            else {
+                for (int i = 0; i < 4; i++) {
+                    dst[i] = i < comps ? src[i] : 255;
+                }
+            }
+        }
+    }
+    levels.push_back(std::move(base));
+
+    // Box filter down to a single texel
+    while (levels.back().width > 1 || levels.back().height > 1) {
+        const Level &prev = levels.back();
+        Level next = allocLevel(std::max(1, prev.width / 2), std::max(1, prev.height / 2));
+        for (int y = 0; y < next.height; y++) {
+            for (int x = 0; x < next.width; x++) {
+                int x0 = std::min(2 * x, prev.width - 1), x1 = std::min(2 * x + 1, prev.width - 1);
+                int y0 = std::min(2 * y, prev.height - 1), y1 = std::min(2 * y + 1, prev.height - 1);
+                uint8_t *dst = next.texel(x, y);
+                for (int i = 0; i < 4; i++) {
+                    int sum = prev.texel(x0, y0)[i] + prev.texel(x1, y0)[i] + prev.texel(x0, y1)[i] + prev.texel(x1, y1)[i];
+                    dst[i] = (sum + 2) / 4;
+                }
+            }
+        }
+        levels.push_back(std::move(next));
+    }
+}
+
+const RTTexture *RTTexture::get(Texture *texture) {
+    static mutex cacheMutex;
+    static unordered_map<Texture *, unique_ptr<RTTexture>> cache;
+    if (!texture) {
+        return nullptr;
+    }
+    lock_guard<mutex> lock(cacheMutex);
+    unique_ptr<RTTexture> &converted = cache[texture];
+    if (!converted) {
+        converted = make_unique<RTTexture>(*texture);
+    }
+    return converted.get();
+}
+
+glm::vec3 RTTexture::bilerp(const Level &level, const glm::vec2 &uv) const {
+    // Texel centers sit at half integer coordinates
+    float x = uv.x * level.width - 0.5f;
+    float y = uv.y * level.height - 0.5f;
+    float fx = floor(x), fy = floor(y);
+    float dx = x - fx, dy = y - fy;
+    auto wrap = [](int i, int n) {
+        i %= n;
+        return i < 0 ? i + n : i;
+    };
+    int x0 = wrap((int) fx, level.width), x1 = wrap(x0 + 1, level.width);
+    int y0 = wrap((int) fy, level.height), y1 = wrap(y0 + 1, level.height);
+
+    vec3 color(0);
+    const uint8_t *corners[4] = { level.texel(x0, y0), level.texel(x1, y0), level.texel(x0, y1), level.texel(x1, y1) };
+    float weights[4] = { (1 - dx) * (1 - dy), dx * (1 - dy), (1 - dx) * dy, dx * dy };
+    for (int c = 0; c < 4; c++) {
+        color += vec3(corners[c][0], corners[c][1], corners[c][2]) * weights[c];
+    }
+    return color;
+}
+
+glm::vec3 RTTexture::lookup(const glm::vec2 &uv, float level) const {
+    level = glm::clamp(level, 0.f, (float) numLevels() - 1);
+    int l0 = (int) level;
+    float t = level - l0;
+    vec3 color = bilerp(levels[l0], uv);
+    if (t > 0 && l0 + 1 < numLevels()) {
+        color = mix(color, bilerp(levels[l0 + 1], uv), t);
+    }
+    return color;
+}
+
+float RTTexture::levelOf(const glm::vec2 &dudx, const glm::vec2 &dudy) const {
+    vec2 size(width(), height());
+    float width = std::max(length(dudx * size), length(dudy * size));
+    if (!(width > 1)) {
+        return 0;
+    }
+    return std::min(log2(width), (float) numLevels() - 1);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+
+class Texture;
+
+// Copy of a texture laid out for the ray tracer. Every mip level is stored as
+// RGBA8 in 4x4 texel tiles, so the 2x2 footprint of a bilinear fetch almost
+// always lands in a single 64 byte cache line. Coordinates wrap like
+// GL_REPEAT.
+class RTTexture {
+  public:
+    explicit RTTexture(const Texture &texture);
+    // Shared copy of texture, converted the first time it is asked for
+    static const RTTexture *get(Texture *texture);
+
+    int width() const { return levels[0].width; }
+    int height() const { return levels[0].height; }
+    int numLevels() const { return (int) levels.size(); }
+    // Trilinear lookup of the color in 0-255, level 0 is the full resolution
+    glm::vec3 lookup(const glm::vec2 &uv, float level) const;
+    // Level whose texels match a footprint of the given uv derivatives
+    float levelOf(const glm::vec2 &dudx, const glm::vec2 &dudy) const;
+
+  private:
+    static const int TileSize = 4;
+    struct Level {
+        int width, height, tilesX;
+        std::vector<uint8_t> texels;
+        const uint8_t *texel(int x, int y) const;
+        uint8_t *texel(int x, int y);
+    };
+    glm::vec3 bilerp(const Level &level, const glm::vec2 &uv) const;
+
+    std::vector<Level> levels;
+};
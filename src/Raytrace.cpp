@@ -1,18 +1,18 @@
 #include "Raytrace.h"
-#include "Shape.h"
 #include <vector>
 #include "Application.h"
-#include "GameObject.h"
-#include "Material.h"
-#include "KDTree.h"
-#include <list>
-#include <fstream>
+#include "SceneAccel.h"
+#include "SceneSnapshot.h"
+#include "RTShading.h"
+#include "RecursiveIntegrator.h"
+#include "PathIntegrator.h"
+#include "WavefrontIntegrator.h"
+#include "PinholeCamera.h"
 #include <iostream>
+#include <sstream>
 #include <algorithm>
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include <stb_image_write.h>
-#define GLM_ENABLE_EXPERIMENTAL
-#include <glm/gtx/intersect.hpp>
+#include <chrono>
+#include <atomic>
 
 using namespace glm;
 using namespace std;
@@ -20,294 +20,341 @@ using namespace std;
 int numBounces;
 int numBounceRays;
 int lightRadius;
+int portalLightDepth;
+bool useLightTree;
 int numShadowSamplesX;
 int numShadowSamplesY;
+SampleSequence sampleSequence;
+int sampleSeed;
+bool adaptiveSampling;
+int minPasses;
+int maxPasses;
+float adaptiveThreshold;
+int pathSamples;
+int rouletteDepth;
+float fov;
+string integrator;
+string accelType;
+bool verbose;
+bool useIrradianceCache;
+float irradianceCacheError, irradianceCacheMinRadius, irradianceCacheMaxRadius;
+bool useDenoiser;
+DenoiseSettings denoiseSettings;
+bool useTemporalCache;
+float temporalDepthTolerance;
+int temporalMaxAge;
+bool useRestir;
+int restirCandidates;
+int restirSpatialSamples;
+float restirSpatialRadius;
+int restirHistory;
+
+// Running mean of a pixel's shading passes with Welford's variance of their
+// luminance, used to stop adding passes once the mean has settled
+struct PixelEstimate {
+    int n = 0;
+    glm::vec3 mean = glm::vec3(0);
+    float lumMean = 0, m2 = 0;
+
+    void add(const glm::vec3 &c) {
+        n++;
+        mean += (c - mean) / (float) n;
+        float lum = dot(c, vec3(0.2126f, 0.7152f, 0.0722f));
+        float delta = lum - lumMean;
+        lumMean += delta / n;
+        m2 += delta * (lum - lumMean);
+    }
 
-glm::vec3 randomDirInSphere(const glm::vec3 &normal) {
-    vec3 dir = normalize(vec3(rand() % 2000 - 1000, rand() % 2000 - 1000, rand() % 2000 - 1000));
-    if (dot(dir, normal) < 0) {
-        dir = -dir;
+    // Standard error of the mean is below threshold relative to the mean, or
+    // below half a display step in the dark
+    bool converged(float threshold) const {
+        if (n < 2) {
+            return false;
+        }
+        float stdError = sqrt(m2 / (n - 1) / n);
+        return stdError <= std::max(threshold * lumMean, 0.5f);
     }
-    return dir;
-}
+};
+
+// Denoiser features of the surface a camera ray sees, following it through
+// open portals. The depth is the total distance along the way.
+void primaryFeatures(Ray ray, SurfaceInteraction hit, const SceneAccel &accel, FeatureBuffers &features, int pixelIdx) {
+    float depth = 0;
+    for (int portalHops = 0; portalHops <= maxPortalHops; portalHops++) {
+        depth += hit.d;
+        vec3 vert[3] = { hit.vert(0), hit.vert(1), hit.vert(2) };
+        vec3 hitPos = hit.u * vert[1] + hit.v * vert[2] + (1 - hit.u - hit.v) * vert[0];
+        vec3 hitNorm = hit.normal();
+
+        if (hit.kind == ObjectKind::Portal && !hit.material) {
+            Portal *portal = static_cast<Portal *>(hit.obj);
+            if (portal->open && portal->linkedPortal->open) {
+                const mat4 &toLinked = accel.scene().portalTransform(*portal).toLinked;
+                vec3 newEye = vec3(toLinked * vec4(ray.o, 1));
+                vec3 newOrig = vec3(toLinked * vec4(hitPos, 1));
+                Ray portalRay(newOrig, normalize(newOrig - newEye));
+                portalDifferentials(ray, hitPos, hitNorm, toLinked, portalRay);
+                ray = portalRay;
+                if (!accel.Intersect(ray, hit)) {
+                    return;
+                }
+                continue;
+            }
+        }
 
-bool fastCheckPortal(const glm::vec3 &orig, const glm::vec3 &dir, Portal &portal) {
-    float d;
-    if (glm::intersectRayPlane(orig, dir, portal.position, portal.getForward(), d)) {
-        vec3 hitPos = orig + dir * d;
-        return portal.pointInSideBounds(hitPos);
+        vec3 albedo = hit.material ? surfaceTexColor(ray, hit) / 255.f : vec3(1);
+        features.set(pixelIdx, albedo, hitNorm, depth);
+        return;
     }
-    return false;
 }
 
-bool checkShadow(const glm::vec3 pos, const glm::vec3 lightPos, const KdTreeAccel &kdtree) {
-    Ray shadowRay(pos, normalize(lightPos - pos), distance(lightPos, pos));
-    return kdtree.IntersectP(shadowRay);
+void loadRTSettings() {
+    fov = app.settings.map->GetInteger("raytracing", "fov", 60);
+    numBounces = app.settings.map->GetInteger("raytracing", "num_bounces", 1);
+    numBounceRays = app.settings.map->GetInteger("raytracing", "num_bounce_rays", 16);
+    lightRadius = app.settings.map->GetInteger("raytracing", "light_radius", 2);
+    portalLightDepth = app.settings.map->GetInteger("raytracing", "portal_light_depth", 1);
+    useLightTree = app.settings.map->GetBoolean("raytracing", "light_tree", false);
+    numShadowSamplesX = app.settings.map->GetInteger("raytracing", "num_shadow_samples_x", 3);
+    numShadowSamplesY = app.settings.map->GetInteger("raytracing", "num_shadow_samples_y", 3);
+    sampleSequence = parseSampleSequence(app.settings.map->GetString("raytracing", "sampler", "sobol"));
+    sampleSeed = app.settings.map->GetInteger("raytracing", "seed", 0);
+    adaptiveSampling = app.settings.map->GetBoolean("raytracing", "adaptive", false);
+    minPasses = std::max(1L, app.settings.map->GetInteger("raytracing", "adaptive_min_passes", 2));
+    maxPasses = std::max((long) minPasses, app.settings.map->GetInteger("raytracing", "adaptive_max_passes", 16));
+    adaptiveThreshold = app.settings.map->GetReal("raytracing", "adaptive_threshold", 0.02);
+    pathSamples = std::max(1L, app.settings.map->GetInteger("raytracing", "path_samples", 16));
+    rouletteDepth = app.settings.map->GetInteger("raytracing", "roulette_depth", 2);
+    integrator = app.settings.map->GetString("raytracing", "integrator", "recursive");
+    if (integrator != "recursive" && integrator != "wavefront" && integrator != "path") {
+        cout << "Unknown integrator: " << integrator << ", using recursive" << endl;
+        integrator = "recursive";
+    }
+    accelType = app.settings.map->GetString("raytracing", "accelerator", "kdtree");
+    verbose = app.settings.map->GetBoolean("raytracing", "verbose", false);
+
+    useIrradianceCache = app.settings.map->GetBoolean("raytracing", "irradiance_cache", false) && integrator == "recursive";
+    irradianceCacheError = app.settings.map->GetReal("raytracing", "irradiance_cache_error", 0.3);
+    irradianceCacheMinRadius = app.settings.map->GetReal("raytracing", "irradiance_cache_min_radius", 0.5);
+    irradianceCacheMaxRadius = app.settings.map->GetReal("raytracing", "irradiance_cache_max_radius", 8);
+
+    useDenoiser = app.settings.map->GetBoolean("raytracing", "denoise", false);
+    denoiseSettings.iterations = app.settings.map->GetInteger("raytracing", "denoise_iterations", denoiseSettings.iterations);
+    denoiseSettings.colorSigma = app.settings.map->GetReal("raytracing", "denoise_color_sigma", denoiseSettings.colorSigma);
+    denoiseSettings.normalPower = app.settings.map->GetReal("raytracing", "denoise_normal_power", denoiseSettings.normalPower);
+    denoiseSettings.depthSigma = app.settings.map->GetReal("raytracing", "denoise_depth_sigma", denoiseSettings.depthSigma);
+
+    useTemporalCache = app.settings.map->GetBoolean("raytracing", "temporal", false) && integrator == "recursive";
+    temporalDepthTolerance = app.settings.map->GetReal("raytracing", "temporal_depth_tolerance", 0.02);
+    temporalMaxAge = app.settings.map->GetInteger("raytracing", "temporal_max_age", 8);
+
+    useRestir = app.settings.map->GetBoolean("raytracing", "restir", false) && integrator == "recursive";
+    restirCandidates = std::max(1L, app.settings.map->GetInteger("raytracing", "restir_candidates", 8));
+    restirSpatialSamples = app.settings.map->GetInteger("raytracing", "restir_spatial_samples", 4);
+    restirSpatialRadius = app.settings.map->GetReal("raytracing", "restir_spatial_radius", 16);
+    restirHistory = app.settings.map->GetInteger("raytracing", "restir_history", 20);
 }
 
-bool checkShadowThroughPortal(const glm::vec3 pos, const glm::vec3 &lightPos, Portal &portal, const KdTreeAccel &kdtree, glm::vec3 &transformedLightPos) {
-    if (!portal.open || !portal.linkedPortal->open || !portal.facing(pos) || !portal.linkedPortal->facing(lightPos)) {
-        return true;
+void renderRT(SceneAccel &sceneAccel, RenderCaches &caches, std::shared_ptr<SceneSnapshot> scene, int width, int height,
+              const std::string &filename, const TileScheduler::Progress &progress) {
+    vector<unsigned char> pixels(width * height * 3);
+    PinholeCamera camera;
+    camera.invHeight = 1.0f / height;
+    camera.invWidth = 1.0f / width;
+    camera.aspect = width * camera.invHeight;
+    camera.angle = tan(M_PI * 0.5 * fov / 180);
+    camera.view = mat4_cast(quatLookAt(scene->lookAtPoint - scene->eye, scene->upVec));
+    camera.eye = scene->eye;
+
+    auto buildStart = chrono::steady_clock::now();
+    sceneAccel.update(std::move(scene), accelType);
+    auto traceStart = chrono::steady_clock::now();
+    sceneAccel.scene().findVirtualLights(portalLightDepth, lightRadius);
+    if (useLightTree || useRestir) {
+        sceneAccel.scene().lightTree.build(sceneAccel.scene(), lightRadius);
     }
 
-    MatrixStack camTransform2;
-    camTransform2.translate(portal.position);
-    camTransform2.rotate(M_PI, portal.getUp());
-    camTransform2.rotate(portal.orientation);
-    camTransform2.rotate(inverse(portal.linkedPortal->orientation));
-    camTransform2.translate(-portal.linkedPortal->position);
-
-    transformedLightPos = vec3(camTransform2.topMatrix() * vec4(lightPos, 1));
-    vec3 lightDir = normalize(transformedLightPos - pos);
-    Ray portalRay(pos, lightDir);
-
-    SurfaceInteraction shadowRayHit;
-    if (fastCheckPortal(pos, lightDir, portal)
-            && kdtree.Intersect(portalRay, shadowRayHit)
-            && shadowRayHit.tri->obj == &portal) {
-        vec3 (&vert2)[3] = shadowRayHit.tri->verts;
-        Shape *model2 = shadowRayHit.tri->obj->getModel();
-
-        MatrixStack camTransform;
-        camTransform.translate(portal.linkedPortal->position);
-        camTransform.rotate(M_PI, portal.linkedPortal->getUp());
-        camTransform.rotate(portal.linkedPortal->orientation);
-        camTransform.rotate(inverse(portal.orientation));
-        camTransform.translate(-portal.position);
-
-        vec3 shadowHitPos = shadowRayHit.u * vert2[1] + shadowRayHit.v * vert2[2] + (1 - shadowRayHit.u - shadowRayHit.v) * vert2[0];
-        vec3 shadowOrig = vec3(camTransform.topMatrix() * vec4(shadowHitPos, 1));
-        return checkShadow(shadowOrig, lightPos, kdtree);
+    if (useIrradianceCache) {
+        // The cached light depends on the walls, the portals and how bounces are traced
+        string sceneKey = to_string(sceneAccel.staticVersion()) + " " + to_string(numBounces) + " " +
+                          to_string(numBounceRays) + " " + to_string((int) sampleSequence) + " " + to_string(sampleSeed) + " " +
+                          sceneAccel.scene().portalKey();
+        caches.irradiance.update(irradianceCacheError, irradianceCacheMinRadius, irradianceCacheMaxRadius, sceneKey);
     }
-    return true;
-}
-
-glm::vec3 traceColor(const Ray &ray, const KdTreeAccel &kdtree, int bounceDepth = 0) {
-    SurfaceInteraction hit;
-    if (!kdtree.Intersect(ray, hit)) {
-        return vec3(0, 0, 0);
+    if (useTemporalCache) {
+        string temporalKey = to_string(sceneAccel.staticVersion()) + " " + to_string(numBounces) + " " +
+                             to_string(numBounceRays) + " " + to_string((int) sampleSequence) + " " +
+                             to_string(sampleSeed) + " " + to_string(useIrradianceCache) + " " +
+                             sceneAccel.scene().portalKey();
+        caches.temporal.beginFrame(camera, width, height, sceneAccel.scene(), temporalKey, temporalDepthTolerance, temporalMaxAge);
     }
 
-    vec3 (&vert)[3] = hit.tri->verts;
-    vec2 vt[3];
-    vec3 vn[3];
-    Shape *model = hit.tri->obj->getModel();
-    for (int vNum = 0; vNum < 3; vNum++) {
-        unsigned int vIdx = model->eleBuf[hit.tri->faceIndex*3+vNum];
-        for (int i = 0; i < 3; i++) {
-            vn[vNum][i] = model->norBuf[vIdx*3+i];
-        }
-
-        for (int i = 0; i < 2; i++) {
-            vt[vNum][i] = model->texBuf[vIdx*2+i];
-        }
+    if (useRestir) {
+        caches.resampler.beginFrame(camera, width, height, sceneAccel.scene(), temporalDepthTolerance, restirHistory);
+        resampleDirectLight(caches.resampler, camera, width, height, sceneAccel);
     }
 
-    vec3 hitPos = hit.u * vert[1] + hit.v * vert[2] + (1 - hit.u - hit.v) * vert[0];
-    vec3 hitNorm = normalize(cross(vert[1] - vert[0], vert[2] - vert[0]));
-
-    Material *material = hit.tri->obj->getMaterial();
-    if (material) {
-        Texture *texture = material->getTexture();
-        vec2 uv = hit.u * vt[1] + hit.v * vt[2] + (1 - hit.u - hit.v) * vt[0];
-
-        // scale UV for Wall objects
-        if (dynamic_cast<Wall *>(hit.tri->obj)) {
-            Wall *wall = static_cast<Wall *>(hit.tri->obj);
-            if (dot(vn[0], vec3(1, 0, 0)) != 0) {
-                uv.x *= wall->size.y;
-                uv.y *= wall->size.z;
-            } else if (dot(vn[0], vec3(0, 1, 0)) != 0) {
-                uv.x *= wall->size.x;
-                uv.y *= wall->size.z;
-            } else if (dot(vn[0], vec3(0, 0, 1)) != 0) {
-                uv.x *= wall->size.y;
-                uv.y *= wall->size.x;
-            }
-        }
-
-        if (uv.x > 1.0f) {
-            uv.x = fmod(uv.x, 1.0f);
-        }
-        if (uv.y > 1.0f) {
-            uv.y = fmod(uv.y, 1.0f);
-        }
-
-        uv.x *= texture->width;
-        uv.y *= texture->height;
-
-        // blerp
-        ivec2 center = round(uv);
-        vec2 delta = (vec2) center - uv + 0.5f;
-        vec3 texColor(0);
-        for (int x = 0; x < 2; x++) {
-            for (int y = 0; y < 2; y++) {
-                int idxX = center.x + x - 1;
-                int idxY = center.y + y - 1;
-
-                if (idxX == texture->width) {
-                    idxX = 0;
-                }
-                else if (idxX == -1) {
-                    idxX = texture->width - 1;
-                }
-                if (idxY == texture->height) {
-                    idxY = 0;
-                }
-                else if (idxY == -1) {
-                    idxY = texture->height - 1;
-                }
-
-                int idx = idxY * texture->width + idxX;
-                vec3 sample;
-                for (int i = 0; i < 3; i++) {
-                    sample[i] = texture->data[idx*3+i];
-                }
-                texColor += sample * (x == 0 ? delta.x : 1 - delta.x) * (y == 0 ? delta.y : 1 - delta.y);
-            }
-        }
-
-        vec3 color(0);
-        for (const Light &light : app.lights) {
-            // Blinn-Phong shading
-            vec3 ambient = material->amb * texColor * light.intensity;
-            //color += ambient;
-
-            // Shadow rays
-            vector<Light> lightSamples;
-            vec3 lightForward = normalize(hitPos - light.position);
-            vec3 lightRight = cross(vec3(0, 1, 0), lightForward);
-            vec3 lightUp = cross(lightForward, lightRight);
-            vec3 directLight(0);
-            if (bounceDepth > 0 || numShadowSamplesX * numShadowSamplesY == 1) {
-                if (!checkShadow(hitPos, light.position, kdtree)) {
-                    Light lightSample = light;
-                    lightSample.position = light.position;
-                    lightSamples.push_back(lightSample);
-                }
-                // Check for light through portals
-                for (Portal &portal : app.portals) {
-                    vec3 transformedLightPos;
-                    if (!checkShadowThroughPortal(hitPos, light.position, portal, kdtree, transformedLightPos)) {
-                        Light lightSample = light;
-                        lightSample.position = transformedLightPos;
-                        lightSamples.push_back(lightSample);
+    FeatureBuffers features(useDenoiser ? width : 0, useDenoiser ? height : 0);
+
+    // Kept in floating point until the denoiser has run
+    vector<vec3> image(width * height);
+    auto writePixel = [&](int pixelIdx, const vec3 &pixel) {
+        image[pixelIdx] = pixel;
+    };
+
+    atomic<long> totalPasses(0), totalReused(0);
+    if (integrator == "wavefront") {
+        // Bigger tiles give longer, more coherent queues
+        TileScheduler scheduler(width, height, 64);
+        scheduler.run([&](const Tile &tile) {
+            int tileWidth = tile.x1 - tile.x0;
+            vector<vec3> radiance;
+            traceWavefrontTile(tile, camera, width, sceneAccel, radiance);
+            for (int py = tile.y0; py < tile.y1; py++) {
+                for (int px = tile.x0; px < tile.x1; px++) {
+                    writePixel(py * width + px, radiance[(py - tile.y0) * tileWidth + (px - tile.x0)]);
+                    // The camera hits are not kept by the queues, so trace them again
+                    SurfaceInteraction hit;
+                    Ray ray = camera.generateRay(px, py);
+                    if (useDenoiser && sceneAccel.Intersect(ray, hit)) {
+                        primaryFeatures(ray, hit, sceneAccel, features, py * width + px);
                     }
                 }
             }
-            else {
-                for (int x = 0; x < numShadowSamplesX; x++) {
-                    for (int y = 0; y < numShadowSamplesY; y++) {
-                        float offsetX = (x - numShadowSamplesX / 2.f + 0.5f + (rand() / (float) RAND_MAX - 0.5)) / numShadowSamplesX * lightRadius;
-                        float offsetY = (y - numShadowSamplesY / 2.f + 0.5f + (rand() / (float) RAND_MAX - 0.5)) / numShadowSamplesY * lightRadius;
-
-                        vec3 samplePos = light.position + lightRight * offsetX + lightUp * offsetY;
-
-                        if (!checkShadow(hitPos, samplePos, kdtree)) {
-                            Light lightSample = light;
-                            lightSample.position = samplePos;
-                            lightSamples.push_back(lightSample);
+        }, progress);
+    }
+    else {
+        // Primary rays are traced in 2x2 pixel packets within each tile. A pass
+        // is one shadeHit call, or one path with the path integrator.
+        bool usePaths = integrator == "path";
+        int fixedPasses = usePaths ? pathSamples : 1;
+        TileScheduler scheduler(width, height);
+        scheduler.run([&](const Tile &tile) {
+            long tilePasses = 0, tileReused = 0;
+            for (int y = tile.y0; y < tile.y1; y += 2) {
+                for (int x = tile.x0; x < tile.x1; x += 2) {
+                    Ray rays[RayPacket::Size];
+                    int pixelIdx[RayPacket::Size];
+                    int count = 0;
+                    for (int py = y; py < std::min(y + 2, tile.y1); py++) {
+                        for (int px = x; px < std::min(x + 2, tile.x1); px++) {
+                            rays[count] = camera.generateRay(px, py);
+                            pixelIdx[count] = py * width + px;
+                            count++;
                         }
-                        // Check for light through portals
-                        for (Portal &portal : app.portals) {
-                            vec3 transformedLightPos;
-                            if (!checkShadowThroughPortal(hitPos, samplePos, portal, kdtree, transformedLightPos)) {
-                                Light lightSample = light;
-                                lightSample.position = transformedLightPos;
-                                lightSamples.push_back(lightSample);
+                    }
+
+                    SurfaceInteraction hits[RayPacket::Size];
+                    int hitMask = sceneAccel.Intersect(RayPacket(rays, count), hits);
+                    for (int lane = 0; lane < count; lane++) {
+                        vec3 pixel(0);
+                        if (hitMask & (1 << lane)) {
+                            // Seeded per pixel so the result does not depend on the thread
+                            Sampler sampler(sampleSequence, sampleSeed, pixelIdx[lane]);
+                            vector<SampleSet> pathSets;
+                            if (usePaths) {
+                                pathSets = pathSampleSets(sampler, pathLightSets(sceneAccel.scene()));
+                            }
+                            // Indirect light reprojected from the last frame
+                            const SurfaceInteraction &hit = hits[lane];
+                            bool temporal = useTemporalCache && hit.material;
+                            IndirectLight indirect;
+                            int age = 0;
+                            if (temporal) {
+                                vec3 hitPos = hit.u * hit.vert(1) + hit.v * hit.vert(2) + (1 - hit.u - hit.v) * hit.vert(0);
+                                indirect.reuse = caches.temporal.lookup(hitPos, hit.obj, indirect.value, age);
+                            }
+                            CameraHitLight cached;
+                            if (useIrradianceCache) {
+                                cached.irradianceCache = &caches.irradiance;
+                            }
+                            // Direct light resampled before the tiles were traced
+                            if (useRestir && hit.material && caches.resampler.surface(pixelIdx[lane]).obj == hit.obj) {
+                                cached.reservoir = &caches.resampler.reservoir(pixelIdx[lane]);
+                            }
+                            vec3 indirectSum(0);
+                            auto shadePass = [&](int pass) {
+                                if (usePaths) {
+                                    return tracePath(rays[lane], hit, sceneAccel, pathSets, pass);
+                                }
+                                IndirectLight passIndirect = indirect;
+                                CameraHitLight passCached = cached;
+                                if (temporal) {
+                                    passCached.indirect = &passIndirect;
+                                }
+                                vec3 color = shadeHit(rays[lane], hit, sceneAccel, sampler, 0, passCached);
+                                indirectSum += passIndirect.value;
+                                return color;
+                            };
+
+                            PixelEstimate estimate;
+                            if (!adaptiveSampling) {
+                                while (estimate.n < fixedPasses) {
+                                    estimate.add(shadePass(estimate.n));
+                                }
+                            }
+                            else {
+                                // Passes are added until the pixel converges
+                                do {
+                                    estimate.add(shadePass(estimate.n));
+                                } while (estimate.n < maxPasses &&
+                                         (estimate.n < minPasses || !estimate.converged(adaptiveThreshold)));
+                            }
+                            pixel = estimate.mean;
+                            tilePasses += estimate.n;
+                            if (temporal) {
+                                caches.temporal.record(pixelIdx[lane], hit.obj, hit.d, indirectSum / (float) estimate.n,
+                                                     indirect.reuse ? age + 1 : 0);
+                                tileReused += indirect.reuse;
+                            }
+                            if (useDenoiser) {
+                                primaryFeatures(rays[lane], hits[lane], sceneAccel, features, pixelIdx[lane]);
                             }
                         }
+                        writePixel(pixelIdx[lane], pixel);
                     }
                 }
             }
-            for (const Light &lightSample : lightSamples) {
-                vec3 lightDir = normalize(lightSample.position - hitPos);
-                vec3 diffuse = material->dif * texColor * std::max(0.f, dot(hitNorm, lightDir)) * light.intensity;
-                vec3 H = normalize((lightDir - ray.d) / 2.f);
-                vec3 specular = material->spec * std::pow(std::max(0.f, dot(H, hitNorm)), material->shine) * light.intensity * 255.f;
-                directLight += diffuse + specular;
-            }
-            if (bounceDepth == 0) {
-                directLight /= (float) (numShadowSamplesX * numShadowSamplesY);
-            }
-            color += directLight;
-        }
-
-        if (bounceDepth < numBounces) {
-            vec3 indirectLight(0);
-            for (int i = 0; i < numBounceRays / pow(2, bounceDepth); i++) {
-                vec3 dir = randomDirInSphere(hitNorm);
-                Ray bounceRay(hitPos, dir);
-                indirectLight += traceColor(bounceRay, kdtree, bounceDepth + 1);
-            }
-            color += indirectLight * texColor / 255.f / (float) numBounceRays;
-        }
-
-        return color;
+            totalPasses += tilePasses;
+            totalReused += tileReused;
+        }, progress);
     }
-    else if (dynamic_cast<Portal *>(hit.tri->obj)) {
-        Portal *portal = static_cast<Portal *>(hit.tri->obj);
-        if (!portal->open || !portal->linkedPortal->open) {
-            if (portal->hasOutline) {
-                return portal->outline->color * 255.f;
-            }
-            else {
-                return vec3(0);
-            }
+    auto traceEnd = chrono::steady_clock::now();
+    if (useDenoiser) {
+        denoise(image, features, denoiseSettings);
+    }
+    auto denoiseEnd = chrono::steady_clock::now();
+    for (int pixelIdx = 0; pixelIdx < width * height; pixelIdx++) {
+        for (int i = 0; i < 3; i++) {
+            pixels[pixelIdx*3+i] = (unsigned char) (std::max(0, std::min(255, (int) round(image[pixelIdx][i]))));
         }
-
-        MatrixStack camTransform;
-        camTransform.translate(portal->linkedPortal->position);
-        camTransform.rotate(M_PI, portal->linkedPortal->getUp());
-        camTransform.rotate(portal->linkedPortal->orientation);
-        camTransform.rotate(inverse(portal->orientation));
-        camTransform.translate(-portal->position);
-
-        vec3 newEye = vec3(camTransform.topMatrix() * vec4(ray.o, 1));
-        vec3 newOrig = vec3(camTransform.topMatrix() * vec4(hitPos, 1));
-        vec3 newDir = normalize(newOrig - newEye);
-        Ray portalRay(newOrig, newDir);
-        return traceColor(portalRay, kdtree, bounceDepth);
     }
-    else if (dynamic_cast<PortalOutline *>(hit.tri->obj)) {
-        return static_cast<PortalOutline *>(hit.tri->obj)->color * 255.f;
+    if (useTemporalCache) {
+        caches.temporal.endFrame();
     }
-    else {
-        return vec3(255);
+    if (useRestir) {
+        caches.resampler.endFrame();
     }
-}
-
-void renderRT(int width, int height, const std::string &filename) {
-    unsigned char *pixels = new unsigned char[width * height * 3];
-    float invHeight = 1.0f / height;
-    float invWidth = 1.0f / width;
-    float aspect = width * invHeight;
-    float fov = app.settings.map->GetInteger("raytracing", "fov", 60);
-    float angle = tan(M_PI * 0.5 * fov / 180);
-    mat4 view = mat4_cast(quatLookAt(app.player.camera.lookAtPoint - app.player.camera.eye, app.player.camera.upVec));
-
-    numBounces = app.settings.map->GetInteger("raytracing", "num_bounces", 1);
-    numBounceRays = app.settings.map->GetInteger("raytracing", "num_bounce_rays", 16);
-    lightRadius = app.settings.map->GetInteger("raytracing", "light_radius", 2);
-    numShadowSamplesX = app.settings.map->GetInteger("raytracing", "num_shadow_samples_x", 3);
-    numShadowSamplesY = app.settings.map->GetInteger("raytracing", "num_shadow_samples_y", 3);
 
-    KdTreeAccel kdtree(app.gameObjects, 80, 1, 0.5, 1, -1);
-
-    #pragma omp parallel for collapse(2)
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            float xx = (2 * ((x + 0.5) * invWidth) - 1) * angle * aspect;
-            float yy = (1 - 2 * ((y + 0.5) * invHeight)) * angle;
-            vec3 dir = normalize(vec3(view * vec4(xx, yy, -1, 0)));
-            vec3 orig = app.player.camera.eye;
-            Ray ray(orig, dir);
-            vec3 pixel = traceColor(ray, kdtree);
-            for (int i = 0; i < 3; i++) {
-                pixels[(y*width+x)*3+i] = (unsigned char) (std::max(0, std::min(255, (int) round(pixel[i]))));
-            }
+    if (verbose) {
+        // Built as one string so lines of frames traced at the same time do
+        // not interleave
+        ostringstream stats;
+        stats << filename << ": " << accelType << " build: " << chrono::duration<double>(traceStart - buildStart).count()
+              << "s, " << integrator << " trace: " << chrono::duration<double>(traceEnd - traceStart).count() << "s" << endl;
+        if (useDenoiser) {
+            stats << "denoise: " << chrono::duration<double>(denoiseEnd - traceEnd).count() << "s" << endl;
+        }
+        if (useIrradianceCache) {
+            stats << "irradiance cache records: " << caches.irradiance.size() << endl;
+        }
+        if (useTemporalCache) {
+            stats << "pixels reusing last frame's indirect light: " << 100.0 * totalReused.load() / (width * height) << "%" << endl;
+        }
+        if (adaptiveSampling && integrator != "wavefront") {
+            stats << "average shading passes per pixel: " << (double) totalPasses.load() / (width * height) << endl;
         }
+        cout << stats.str() << flush;
     }
-    stbi_write_png(filename.c_str(), width, height, 3, pixels, width * 3);
-    delete[] pixels;
+    app.frameWriter.write(filename, width, height, std::move(pixels));
 }
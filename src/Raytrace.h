@@ -1,7 +1,34 @@
 #pragma once
 
 #include "GameObject.h"
+#include "IrradianceCache.h"
+#include "LightResampler.h"
+#include "TemporalCache.h"
+#include "TileScheduler.h"
+#include <memory>
 #include <string>
 #include <glm/glm.hpp>
 
-void renderRT(int width, int height, const std::string &filename);
\ No newline at end of file
+class SceneAccel;
+struct SceneSnapshot;
+
+// Read the [raytracing] settings, before any frame is traced
+void loadRTSettings();
+
+// Light kept across the frames traced with it, each is only used when its
+// setting is on
+struct RenderCaches {
+    // Indirect light on the walls, kept while the walls and portals stay the same
+    IrradianceCache irradiance;
+    // Indirect light of the last frame's camera hits
+    TemporalCache temporal;
+    // Direct light reservoirs of the last frame's camera hits
+    LightResampler resampler;
+};
+
+// Ray trace the camera's view of scene into a png, written by app.frameWriter.
+// sceneAccel is brought up to date with scene first. Frames traced at the same
+// time need accelerators and caches of their own, and the temporal cache and
+// the resampler expect the frames in order. progress is called as tiles finish.
+void renderRT(SceneAccel &sceneAccel, RenderCaches &caches, std::shared_ptr<SceneSnapshot> scene, int width, int height,
+              const std::string &filename, const TileScheduler::Progress &progress = nullptr);
@@ -0,0 +1,311 @@
+#include "RecursiveIntegrator.h"
+#include "Material.h"
+#include "RTShading.h"
+#include "TileScheduler.h"
+#include <algorithm>
+
+using namespace glm;
+using namespace std;
+
+// Direct light from lights picked by the light tree. Every shadow ray picks
+// its own light, so a hit costs the same number of shadow rays however many
+// lights there are.
+glm::vec3 lightTreeDirect(const Ray &ray, const glm::vec3 &hitPos, const glm::vec3 &hitNorm, const Material *material,
+                          const glm::vec3 &texColor, const SceneAccel &accel, Sampler &sampler, int bounceDepth) {
+    SceneSnapshot &scene = accel.scene();
+    int numSamples = softShadows(bounceDepth) ? numShadowSamplesX * numShadowSamplesY : 1;
+    SampleSet pickSet = sampler.startSet();
+    SampleSet lightSet = sampler.startSet();
+    vec3 directLight(0);
+    vector<vec3> directPositions;
+    vector<vec3> directWeights;
+    for (int i = 0; i < numSamples; i++) {
+        LightTreeSample sample;
+        if (!sampleLightTree(scene, hitPos, hitNorm, pickSet[i].x, lightSet[i], bounceDepth, sample)) {
+            continue;
+        }
+        const Light &light = scene.lights[sample.emitter->light];
+        if (!sample.emitter->virtualLight) {
+            directPositions.push_back(sample.position);
+            directWeights.push_back(light.intensity * sample.weight);
+            continue;
+        }
+        vec3 transformedLightPos;
+        if (!checkShadowThroughPortals(hitPos, sample.position, *sample.emitter->virtualLight, scene, accel,
+                                       transformedLightPos)) {
+            vec3 lightDir = normalize(transformedLightPos - hitPos);
+            directLight += blinnPhong(material, texColor, hitNorm, lightDir, ray.d, light.intensity) * sample.weight;
+        }
+    }
+
+    // Direct shadow rays share an origin, so trace them in packets
+    for (size_t i = 0; i < directPositions.size(); i += RayPacket::Size) {
+        int count = std::min((int) (directPositions.size() - i), RayPacket::Size);
+        int occluded = checkShadowPacket(hitPos, &directPositions[i], count, accel);
+        for (int lane = 0; lane < count; lane++) {
+            if (!(occluded & (1 << lane))) {
+                vec3 lightDir = normalize(directPositions[i + lane] - hitPos);
+                directLight += blinnPhong(material, texColor, hitNorm, lightDir, ray.d, directWeights[i + lane]);
+            }
+        }
+    }
+    return directLight * lightSampleWeight(bounceDepth);
+}
+
+// Unshadowed direct light of a resampled light sample at a camera hit, the
+// target function reservoirs are resampled with
+float restirTarget(const SceneSnapshot &scene, const ResamplingSurface &surface, const LightSample &sample) {
+    if (sample.light < 0 || sample.light >= (int) scene.lights.size()) {
+        return 0;
+    }
+    const Light &light = scene.lights[sample.light];
+    vec3 point = light.position + sample.offset;
+    vec3 seenAt = point;
+    if (sample.virtualLight >= 0) {
+        // Reservoirs from other pixels or frames may hold a portal chain this
+        // hit cannot see through
+        const vector<VirtualLight> &virtualLights = scene.virtualLights[sample.light];
+        if (sample.virtualLight >= (int) virtualLights.size()) {
+            return 0;
+        }
+        const VirtualLight &virtualLight = virtualLights[sample.virtualLight];
+        if (!virtualLight.portals[0]->facing(surface.pos) ||
+            !virtualLight.portals[virtualLight.depth - 1]->linkedPortal->facing(point)) {
+            return 0;
+        }
+        seenAt = vec3(virtualLight.toVirtual[0] * vec4(point, 1));
+    }
+    vec3 lightDir = normalize(seenAt - surface.pos);
+    vec3 color = blinnPhong(surface.material, surface.texColor, surface.normal, lightDir, surface.viewDir, light.intensity);
+    return dot(color, vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+// Reservoir of restirCandidates light tree samples for a camera hit
+Reservoir restirInitial(const SceneSnapshot &scene, const ResamplingSurface &surface, Sampler &sampler) {
+    SampleSet pickSet = sampler.startSet();
+    SampleSet lightSet = sampler.startSet();
+    Reservoir reservoir;
+    for (int i = 0; i < restirCandidates; i++) {
+        LightTreeSample treeSample;
+        LightSample sample;
+        float w = 0;
+        if (sampleLightTree(scene, surface.pos, surface.normal, pickSet[i].x, lightSet[i], 0, treeSample)) {
+            const LightEmitter &emitter = *treeSample.emitter;
+            sample.light = emitter.light;
+            sample.offset = treeSample.position - scene.lights[emitter.light].position;
+            if (emitter.virtualLight) {
+                sample.virtualLight = emitter.virtualLight - scene.virtualLights[emitter.light].data();
+            }
+            w = restirTarget(scene, surface, sample) * treeSample.weight;
+        }
+        reservoir.add(sample, w, 1, sampler.get1D());
+    }
+    reservoir.finalize(restirTarget(scene, surface, reservoir.sample));
+    return reservoir;
+}
+
+// Whether the point of sample can be seen from hitPos, and where it is seen
+bool restirVisible(const SceneSnapshot &scene, const glm::vec3 &hitPos, const LightSample &sample,
+                   const Aggregate &accel, glm::vec3 &seenAt) {
+    const Light &light = scene.lights[sample.light];
+    vec3 point = light.position + sample.offset;
+    if (sample.virtualLight < 0) {
+        seenAt = point;
+        return !checkShadow(hitPos, point, accel);
+    }
+    const VirtualLight &virtualLight = scene.virtualLights[sample.light][sample.virtualLight];
+    return !checkShadowThroughPortals(hitPos, point, virtualLight, scene, accel, seenAt);
+}
+
+// Direct light of a camera hit from its resampled reservoir, one shadow ray
+// however many candidates the reservoir saw
+glm::vec3 restirDirect(const Ray &ray, const glm::vec3 &hitPos, const glm::vec3 &hitNorm, const Material *material,
+                       const glm::vec3 &texColor, const SceneAccel &accel, const Reservoir &reservoir) {
+    SceneSnapshot &scene = accel.scene();
+    const LightSample &sample = reservoir.sample;
+    vec3 seenAt;
+    if (reservoir.weight <= 0 || sample.light < 0 || sample.light >= (int) scene.lights.size() ||
+        (sample.virtualLight >= (int) scene.virtualLights[sample.light].size()) ||
+        !restirVisible(scene, hitPos, sample, accel, seenAt)) {
+        return vec3(0);
+    }
+    vec3 lightDir = normalize(seenAt - hitPos);
+    return blinnPhong(material, texColor, hitNorm, lightDir, ray.d, scene.lights[sample.light].intensity) * reservoir.weight;
+}
+
+glm::vec3 shadeHit(const Ray &ray, const SurfaceInteraction &hit, const SceneAccel &accel, Sampler &sampler, int bounceDepth,
+                   const CameraHitLight &cached) {
+    vec3 vert[3] = { hit.vert(0), hit.vert(1), hit.vert(2) };
+    vec3 hitPos = hit.u * vert[1] + hit.v * vert[2] + (1 - hit.u - hit.v) * vert[0];
+    vec3 hitNorm = hit.normal();
+
+    Material *material = hit.material;
+    if (material) {
+        vec3 texColor = surfaceTexColor(ray, hit);
+
+        vec3 color(0);
+        vector<vec3> samplePositions;
+        SceneSnapshot &scene = accel.scene();
+        if (cached.reservoir) {
+            color += restirDirect(ray, hitPos, hitNorm, material, texColor, accel, *cached.reservoir);
+        }
+        else if (useLightTree) {
+            color += lightTreeDirect(ray, hitPos, hitNorm, material, texColor, accel, sampler, bounceDepth);
+        }
+        else {
+            for (size_t lightNum = 0; lightNum < scene.lights.size(); lightNum++) {
+                const Light &light = scene.lights[lightNum];
+                vec3 directLight(0);
+                lightSamplePositions(light, hitPos, sampler, bounceDepth, samplePositions);
+
+                // Direct shadow rays share an origin, so trace them in packets
+                for (size_t i = 0; i < samplePositions.size(); i += RayPacket::Size) {
+                    int count = std::min((int) (samplePositions.size() - i), RayPacket::Size);
+                    int occluded = checkShadowPacket(hitPos, &samplePositions[i], count, accel);
+                    for (int lane = 0; lane < count; lane++) {
+                        const vec3 &samplePos = samplePositions[i + lane];
+                        if (!(occluded & (1 << lane))) {
+                            vec3 lightDir = normalize(samplePos - hitPos);
+                            directLight += blinnPhong(material, texColor, hitNorm, lightDir, ray.d, light.intensity);
+                        }
+                        // Check for light through portals
+                        for (const VirtualLight &virtualLight : scene.virtualLights[lightNum]) {
+                            vec3 transformedLightPos;
+                            if (!checkShadowThroughPortals(hitPos, samplePos, virtualLight, scene, accel, transformedLightPos)) {
+                                vec3 lightDir = normalize(transformedLightPos - hitPos);
+                                directLight += blinnPhong(material, texColor, hitNorm, lightDir, ray.d, light.intensity);
+                            }
+                        }
+                    }
+                }
+                color += directLight * lightSampleWeight(bounceDepth);
+            }
+        }
+
+        if (bounceDepth < numBounces) {
+            vec3 irradiance;
+            IrradianceCache *irradianceCache = bounceDepth == 0 ? cached.irradianceCache : nullptr;
+            if (cached.indirect && cached.indirect->reuse) {
+                irradiance = cached.indirect->value;
+            }
+            else if (irradianceCache && hit.kind == ObjectKind::Wall) {
+                // Walls are diffuse and seen by many pixels, so their indirect
+                // light is interpolated from records computed nearby
+                if (!irradianceCache->lookup(hitPos, hitNorm, irradiance)) {
+                    vector<IrradianceSample> samples;
+                    SampleSet bounceSet = sampler.startSet();
+                    for (int i = 0; i < bounceRayCount(bounceDepth); i++) {
+                        vec3 dir = sampleHemisphere(hitNorm, bounceSet[i]);
+                        Ray bounceRay(hitPos, dir);
+                        SurfaceInteraction bounceHit;
+                        if (accel.Intersect(bounceRay, bounceHit)) {
+                            samples.push_back({ dir, shadeHit(bounceRay, bounceHit, accel, sampler, bounceDepth + 1), bounceHit.d });
+                        }
+                        else {
+                            samples.push_back({ dir, vec3(0), INFINITY });
+                        }
+                    }
+                    IrradianceRecord record = irradianceCache->createRecord(hitPos, hitNorm, samples);
+                    irradianceCache->add(record);
+                    irradiance = record.irradiance;
+                }
+            }
+            else {
+                vec3 indirectLight(0);
+                SampleSet bounceSet = sampler.startSet();
+                for (int i = 0; i < bounceRayCount(bounceDepth); i++) {
+                    vec3 dir = sampleHemisphere(hitNorm, bounceSet[i]);
+                    Ray bounceRay(hitPos, dir);
+                    indirectLight += traceColor(bounceRay, accel, sampler, bounceDepth + 1);
+                }
+                irradiance = indirectLight / (float) numBounceRays;
+            }
+            if (cached.indirect) {
+                cached.indirect->value = irradiance;
+            }
+            color += irradiance * texColor / 255.f;
+        }
+
+        return color;
+    }
+    else if (hit.kind == ObjectKind::Portal) {
+        Portal *portal = static_cast<Portal *>(hit.obj);
+        if (!portal->open || !portal->linkedPortal->open) {
+            if (portal->hasOutline) {
+                return portal->outline->color * 255.f;
+            }
+            else {
+                return vec3(0);
+            }
+        }
+
+        const mat4 &toLinked = accel.scene().portalTransform(*portal).toLinked;
+        vec3 newEye = vec3(toLinked * vec4(ray.o, 1));
+        vec3 newOrig = vec3(toLinked * vec4(hitPos, 1));
+        vec3 newDir = normalize(newOrig - newEye);
+        Ray portalRay(newOrig, newDir);
+        portalDifferentials(ray, hitPos, hitNorm, toLinked, portalRay);
+        return traceColor(portalRay, accel, sampler, bounceDepth);
+    }
+    else if (hit.kind == ObjectKind::PortalOutline) {
+        return static_cast<PortalOutline *>(hit.obj)->color * 255.f;
+    }
+    else {
+        return vec3(255);
+    }
+}
+
+glm::vec3 traceColor(const Ray &ray, const SceneAccel &accel, Sampler &sampler, int bounceDepth) {
+    SurfaceInteraction hit;
+    if (!accel.Intersect(ray, hit)) {
+        return vec3(0, 0, 0);
+    }
+    return shadeHit(ray, hit, accel, sampler, bounceDepth);
+}
+void resampleDirectLight(LightResampler &resampler, const PinholeCamera &camera, int width, int height,
+                         const SceneAccel &accel) {
+    const SceneSnapshot &snapshot = accel.scene();
+    uint32_t frameSeed = sampleSeed ^ (resampler.frame() * 0x9e3779b9u);
+    TileScheduler scheduler(width, height);
+    scheduler.run([&](const Tile &tile) {
+        for (int py = tile.y0; py < tile.y1; py++) {
+            for (int px = tile.x0; px < tile.x1; px++) {
+                int pixelIdx = py * width + px;
+                Ray ray = camera.generateRay(px, py);
+                SurfaceInteraction hit;
+                if (!accel.Intersect(ray, hit) || !hit.material) {
+                    continue;
+                }
+                ResamplingSurface surface;
+                surface.obj = hit.obj;
+                surface.material = hit.material;
+                surface.pos = hit.u * hit.vert(1) + hit.v * hit.vert(2) + (1 - hit.u - hit.v) * hit.vert(0);
+                surface.normal = hit.normal();
+                surface.viewDir = ray.d;
+                surface.texColor = surfaceTexColor(ray, hit);
+                surface.depth = hit.d;
+                auto target = [&](const LightSample &sample) { return restirTarget(snapshot, surface, sample); };
+
+                Sampler sampler(sampleSequence, frameSeed, pixelIdx);
+                resampler.setInitial(pixelIdx, surface, restirInitial(snapshot, surface, sampler));
+                Reservoir &reservoir = resampler.reuseTemporal(pixelIdx, target, sampler);
+                // Occluded samples are not passed on to the neighbours
+                vec3 seenAt;
+                if (reservoir.weight > 0 && !restirVisible(snapshot, surface.pos, reservoir.sample, accel, seenAt)) {
+                    reservoir.weight = 0;
+                }
+            }
+        }
+    });
+    scheduler.run([&](const Tile &tile) {
+        for (int py = tile.y0; py < tile.y1; py++) {
+            for (int px = tile.x0; px < tile.x1; px++) {
+                int pixelIdx = py * width + px;
+                const ResamplingSurface &surface = resampler.surface(pixelIdx);
+                auto target = [&](const LightSample &sample) { return restirTarget(snapshot, surface, sample); };
+                Sampler sampler(sampleSequence, frameSeed ^ 0x5bd1e995u, pixelIdx);
+                resampler.reuseSpatial(px, py, restirSpatialSamples, restirSpatialRadius, target, sampler);
+            }
+        }
+    });
+}
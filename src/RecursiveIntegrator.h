@@ -0,0 +1,40 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include "IrradianceCache.h"
+#include "LightResampler.h"
+#include "PinholeCamera.h"
+#include "Sampler.h"
+#include "SceneAccel.h"
+
+// Recursive integrator. Every hit traces its shadow rays and bounceRayCount
+// bounce rays of its own, so the rays per pixel grow with every bounce.
+
+// Indirect light at a camera hit, before it is multiplied by the surface
+// color. Passed to shadeHit to reuse a value instead of tracing bounce rays,
+// and set to the value that was used.
+struct IndirectLight {
+    bool reuse = false;
+    glm::vec3 value = glm::vec3(0);
+};
+
+// Light kept across frames that shadeHit may use at a camera hit instead of
+// tracing it, any of them can be left out
+struct CameraHitLight {
+    // Indirect light on the walls, records missing nearby are added
+    IrradianceCache *irradianceCache = nullptr;
+    // Indirect light reprojected from the last frame
+    IndirectLight *indirect = nullptr;
+    // Direct light resampled before the tiles were traced
+    const Reservoir *reservoir = nullptr;
+};
+
+glm::vec3 shadeHit(const Ray &ray, const SurfaceInteraction &hit, const SceneAccel &accel, Sampler &sampler, int bounceDepth,
+                   const CameraHitLight &cached = CameraHitLight());
+glm::vec3 traceColor(const Ray &ray, const SceneAccel &accel, Sampler &sampler, int bounceDepth = 0);
+
+// Fill the reservoir of every camera hit, once resampler.beginFrame has been
+// called for the frame. Every reservoir is filled before any pixel is
+// shaded, as spatial reuse reads the reservoirs of the pixels around it.
+void resampleDirectLight(LightResampler &resampler, const PinholeCamera &camera, int width, int height,
+                         const SceneAccel &accel);
@@ -0,0 +1,126 @@
+#pragma once
+
+// Small 4-wide float wrapper used by the packet ray tracer. Uses SSE when the
+// compiler targets it and falls back to plain arrays otherwise, so the packet
+// code paths still build on other architectures.
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define RT_USE_SSE
+#include <xmmintrin.h>
+#endif
+
+struct float4 {
+#ifdef RT_USE_SSE
+    __m128 v;
+    float4() {}
+    float4(__m128 v) : v(v) {}
+    explicit float4(float f) : v(_mm_set1_ps(f)) {}
+    float4(float a, float b, float c, float d) : v(_mm_setr_ps(a, b, c, d)) {}
+    static float4 load(const float *p) { return _mm_loadu_ps(p); }
+    void store(float *p) const { _mm_storeu_ps(p, v); }
+    float operator[](int i) const { float f[4]; store(f); return f[i]; }
+#else
+    float v[4];
+    float4() {}
+    explicit float4(float f) { v[0] = v[1] = v[2] = v[3] = f; }
+    float4(float a, float b, float c, float d) { v[0] = a; v[1] = b; v[2] = c; v[3] = d; }
+    static float4 load(const float *p) { return float4(p[0], p[1], p[2], p[3]); }
+    void store(float *p) const { for (int i = 0; i < 4; i++) p[i] = v[i]; }
+    float operator[](int i) const { return v[i]; }
+#endif
+};
+
+#ifdef RT_USE_SSE
+inline float4 operator+(const float4 &a, const float4 &b) { return _mm_add_ps(a.v, b.v); }
+inline float4 operator-(const float4 &a, const float4 &b) { return _mm_sub_ps(a.v, b.v); }
+inline float4 operator*(const float4 &a, const float4 &b) { return _mm_mul_ps(a.v, b.v); }
+inline float4 operator/(const float4 &a, const float4 &b) { return _mm_div_ps(a.v, b.v); }
+// Same operand order as the scalar "a > b ? a : b", so NaNs resolve the same way
+inline float4 max(const float4 &a, const float4 &b) { return _mm_max_ps(a.v, b.v); }
+inline float4 min(const float4 &a, const float4 &b) { return _mm_min_ps(a.v, b.v); }
+// Comparisons return all-ones lanes where true
+inline float4 operator<(const float4 &a, const float4 &b) { return _mm_cmplt_ps(a.v, b.v); }
+inline float4 operator<=(const float4 &a, const float4 &b) { return _mm_cmple_ps(a.v, b.v); }
+inline float4 operator>(const float4 &a, const float4 &b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline float4 operator>=(const float4 &a, const float4 &b) { return _mm_cmpge_ps(a.v, b.v); }
+inline float4 operator==(const float4 &a, const float4 &b) { return _mm_cmpeq_ps(a.v, b.v); }
+inline float4 operator&(const float4 &a, const float4 &b) { return _mm_and_ps(a.v, b.v); }
+inline float4 operator|(const float4 &a, const float4 &b) { return _mm_or_ps(a.v, b.v); }
+inline float4 select(const float4 &mask, const float4 &a, const float4 &b) {
+    return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v));
+}
+inline int movemask(const float4 &mask) { return _mm_movemask_ps(mask.v); }
+#else
+#include <cstring>
+#include <cstdint>
+
+inline float4 float4FromBits(const uint32_t bits[4]) {
+    float4 r;
+    std::memcpy(r.v, bits, sizeof(r.v));
+    return r;
+}
+inline void float4ToBits(const float4 &a, uint32_t bits[4]) { std::memcpy(bits, a.v, sizeof(a.v)); }
+
+#define FLOAT4_BINARY_OP(op) \
+    inline float4 operator op(const float4 &a, const float4 &b) { \
+        return float4(a.v[0] op b.v[0], a.v[1] op b.v[1], a.v[2] op b.v[2], a.v[3] op b.v[3]); \
+    }
+FLOAT4_BINARY_OP(+)
+FLOAT4_BINARY_OP(-)
+FLOAT4_BINARY_OP(*)
+FLOAT4_BINARY_OP(/)
+#undef FLOAT4_BINARY_OP
+
+inline float4 max(const float4 &a, const float4 &b) {
+    float4 r;
+    for (int i = 0; i < 4; i++) r.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i];
+    return r;
+}
+inline float4 min(const float4 &a, const float4 &b) {
+    float4 r;
+    for (int i = 0; i < 4; i++) r.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i];
+    return r;
+}
+
+#define FLOAT4_COMPARE_OP(op) \
+    inline float4 operator op(const float4 &a, const float4 &b) { \
+        uint32_t bits[4]; \
+        for (int i = 0; i < 4; i++) bits[i] = a.v[i] op b.v[i] ? 0xffffffffu : 0u; \
+        return float4FromBits(bits); \
+    }
+FLOAT4_COMPARE_OP(<)
+FLOAT4_COMPARE_OP(<=)
+FLOAT4_COMPARE_OP(>)
+FLOAT4_COMPARE_OP(>=)
+FLOAT4_COMPARE_OP(==)
+#undef FLOAT4_COMPARE_OP
+
+inline float4 operator&(const float4 &a, const float4 &b) {
+    uint32_t ba[4], bb[4];
+    float4ToBits(a, ba);
+    float4ToBits(b, bb);
+    for (int i = 0; i < 4; i++) ba[i] &= bb[i];
+    return float4FromBits(ba);
+}
+inline float4 operator|(const float4 &a, const float4 &b) {
+    uint32_t ba[4], bb[4];
+    float4ToBits(a, ba);
+    float4ToBits(b, bb);
+    for (int i = 0; i < 4; i++) ba[i] |= bb[i];
+    return float4FromBits(ba);
+}
+inline float4 select(const float4 &mask, const float4 &a, const float4 &b) {
+    uint32_t bm[4];
+    float4ToBits(mask, bm);
+    float4 r;
+    for (int i = 0; i < 4; i++) r.v[i] = bm[i] ? a.v[i] : b.v[i];
+    return r;
+}
+inline int movemask(const float4 &mask) {
+    uint32_t bm[4];
+    float4ToBits(mask, bm);
+    int m = 0;
+    for (int i = 0; i < 4; i++) m |= (bm[i] >> 31) << i;
+    return m;
+}
+#endif
@@ -0,0 +1,132 @@
+#include "Sampler.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+using namespace glm;
+using namespace std;
+
+static const float OneMinusEpsilon = 0x1.fffffep-1;
+
+static float toFloat(uint32_t bits) {
+    return std::min(OneMinusEpsilon, bits * 0x1p-32f);
+}
+
+// http://www.jcgt.org/published/0009/03/02/
+static uint32_t mixBits(uint32_t v) {
+    uint32_t state = v * 747796405u + 2891336453u;
+    uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+static float radicalInverse3(uint32_t i) {
+    const float invBase = 1.f / 3;
+    float invBaseN = 1, reversed = 0;
+    while (i) {
+        reversed = reversed * 3 + i % 3;
+        invBaseN *= invBase;
+        i /= 3;
+    }
+    return std::min(OneMinusEpsilon, reversed * invBaseN);
+}
+
+static uint32_t reverseBits(uint32_t n) {
+    n = (n << 16) | (n >> 16);
+    n = ((n & 0x00ff00ff) << 8) | ((n & 0xff00ff00) >> 8);
+    n = ((n & 0x0f0f0f0f) << 4) | ((n & 0xf0f0f0f0) >> 4);
+    n = ((n & 0x33333333) << 2) | ((n & 0xcccccccc) >> 2);
+    n = ((n & 0x55555555) << 1) | ((n & 0xaaaaaaaa) >> 1);
+    return n;
+}
+
+// Second dimension of the Sobol sequence, the first is reverseBits
+static uint32_t sobol2(uint32_t i) {
+    uint32_t r = 0;
+    for (uint32_t v = 1u << 31; i; i >>= 1, v ^= v >> 1) {
+        if (i & 1) {
+            r ^= v;
+        }
+    }
+    return r;
+}
+
+SampleSequence parseSampleSequence(const std::string &name) {
+    if (name == "random") {
+        return SampleSequence::Random;
+    }
+    if (name == "halton") {
+        return SampleSequence::Halton;
+    }
+    if (name != "sobol") {
+        cout << "Unknown sampler: " << name << ", using sobol" << endl;
+    }
+    return SampleSequence::Sobol;
+}
+
+glm::vec2 SampleSet::operator[](uint32_t i) const {
+    switch (sequence) {
+    case SampleSequence::Halton: {
+        // Cranley-Patterson rotation by a per set offset
+        vec2 p(toFloat(reverseBits(i)), radicalInverse3(i));
+        vec2 shift(toFloat(mixBits(seed)), toFloat(mixBits(seed ^ 0x9e3779b9u)));
+        p += shift;
+        return vec2(p.x >= 1 ? p.x - 1 : p.x, p.y >= 1 ? p.y - 1 : p.y);
+    }
+    case SampleSequence::Sobol:
+        // Random digit scrambling keeps the points stratified
+        return vec2(toFloat(reverseBits(i) ^ mixBits(seed)),
+                    toFloat(sobol2(i) ^ mixBits(seed ^ 0x9e3779b9u)));
+    default:
+        return vec2(toFloat(mixBits(seed ^ mixBits(2 * i))), toFloat(mixBits(seed ^ mixBits(2 * i + 1))));
+    }
+}
+
+Sampler::Sampler(SampleSequence sequence, uint32_t seed, uint32_t pixelIndex) : sequence(sequence) {
+    // One PCG stream per pixel, started from the frame seed
+    state = 0;
+    inc = (uint64_t(pixelIndex) << 1u) | 1u;
+    next();
+    state += mixBits(seed);
+    next();
+}
+
+uint32_t Sampler::next() {
+    uint64_t oldState = state;
+    state = oldState * 6364136223846793005ULL + inc;
+    uint32_t xorShifted = (uint32_t) (((oldState >> 18u) ^ oldState) >> 27u);
+    uint32_t rot = (uint32_t) (oldState >> 59u);
+    return (xorShifted >> rot) | (xorShifted << ((~rot + 1u) & 31));
+}
+
+float Sampler::get1D() {
+    return toFloat(next());
+}
+
+glm::vec2 Sampler::get2D() {
+    float x = get1D();
+    return vec2(x, get1D());
+}
+
+SampleSet Sampler::startSet() {
+    SampleSet set;
+    set.sequence = sequence;
+    set.seed = next();
+    return set;
+}
+
+Sampler Sampler::split() {
+    uint32_t seed = next();
+    return Sampler(sequence, seed, next());
+}
+
+glm::vec3 sampleHemisphere(const glm::vec3 &normal, const glm::vec2 &u) {
+    float z = u.x;
+    float r = std::sqrt(std::max(0.f, 1 - z * z));
+    float phi = 2 * M_PI * u.y;
+
+    // Orthonormal basis around the normal
+    vec3 tangent = std::abs(normal.x) > 0.9f ? vec3(0, 1, 0) : vec3(1, 0, 0);
+    vec3 bitangent = normalize(cross(normal, tangent));
+    tangent = cross(bitangent, normal);
+    return r * std::cos(phi) * tangent + r * std::sin(phi) * bitangent + z * normal;
+}
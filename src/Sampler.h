@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <glm/glm.hpp>
+
+// Sequence the 2D sample sets are drawn from
+enum class SampleSequence {
+    Random,
+    Halton,
+    Sobol
+};
+
+// Parse the [raytracing] sampler setting ("random", "halton" or "sobol")
+SampleSequence parseSampleSequence(const std::string &name);
+
+// One set of 2D samples over the unit square, e.g. all the shadow rays to one
+// light or all the bounce rays from one hit. Halton and Sobol sets cover the
+// square evenly for any number of samples. Every set is randomized on its
+// own, so sets drawn for different hits do not line up with each other.
+class SampleSet {
+  public:
+    glm::vec2 operator[](uint32_t i) const;
+
+  private:
+    friend class Sampler;
+    SampleSequence sequence;
+    uint32_t seed;
+};
+
+// Source of the random numbers used while shading one pixel. The numbers only
+// depend on the seed and the pixel, never on the thread or on the order the
+// pixels are rendered in, so renders can be reproduced exactly.
+class Sampler {
+  public:
+    Sampler(SampleSequence sequence, uint32_t seed, uint32_t pixelIndex);
+    float get1D();
+    glm::vec2 get2D();
+    SampleSet startSet();
+    // Independent sampler for a ray spawned while shading, seeded from this
+    // stream so it stays deterministic
+    Sampler split();
+
+  private:
+    // PCG32 state, http://www.pcg-random.org
+    uint32_t next();
+    uint64_t state, inc;
+    SampleSequence sequence;
+};
+
+// Direction in the hemisphere around normal, uniform over solid angle for
+// uniform u
+glm::vec3 sampleHemisphere(const glm::vec3 &normal, const glm::vec2 &u);
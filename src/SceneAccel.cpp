@@ -0,0 +1,104 @@
+#include "SceneAccel.h"
+#include "SceneSnapshot.h"
+
+using namespace glm;
+using namespace std;
+
+void SceneAccel::update(std::shared_ptr<SceneSnapshot> scene, const std::string &type) {
+    // Switching accelerator type invalidates the meshes and both trees
+    bool typeChanged = type != this->type;
+    if (typeChanged) {
+        meshes.clear();
+        this->type = type;
+    }
+
+    if (typeChanged || !staticAccel || scene->staticPlacements != staticPlacements) {
+        staticAccel = buildInstances(scene->staticPlacements);
+        staticPlacements = scene->staticPlacements;
+        staticBuilds++;
+    }
+
+    if (typeChanged || !dynamicAccel || scene->dynamicPlacements != dynamicPlacements) {
+        dynamicAccel = buildInstances(scene->dynamicPlacements);
+    }
+    else {
+        // Nothing moved, but the portals in the tree are the old snapshot's
+        // copies
+        vector<ObjectTag> objects;
+        objects.reserve(scene->dynamicPlacements.size());
+        for (const ObjectPlacement &placement : scene->dynamicPlacements) {
+            objects.push_back(placement.object);
+        }
+        dynamicAccel->setObjects(objects);
+    }
+    dynamicPlacements = scene->dynamicPlacements;
+
+    // Neither tree points into the old snapshot any more, so it can go
+    snapshot = std::move(scene);
+}
+
+std::unique_ptr<InstanceAccel> SceneAccel::buildInstances(const std::vector<ObjectPlacement> &placements) {
+    std::vector<MeshInstance> instances;
+    instances.reserve(placements.size());
+    for (size_t i = 0; i < placements.size(); i++) {
+        const ObjectPlacement &placement = placements[i];
+        Shape *shape = placement.object.obj->getModel();
+        if (shape->eleBuf.empty()) {
+            continue;
+        }
+        MeshInstance instance;
+        instance.object = placement.object;
+        instance.placement = i;
+        instance.mesh = meshes.get(shape, type);
+        instance.objectToWorld = placement.transform;
+        instance.worldToObject = inverse(placement.transform);
+        instance.worldBound = instance.mesh->WorldBound().Transform(placement.transform);
+        instance.shading = bakeShading(placement.object, placement.transform);
+        instances.push_back(std::move(instance));
+    }
+    return make_unique<InstanceAccel>(std::move(instances));
+}
+
+Bounds3f SceneAccel::WorldBound() const {
+    Bounds3f bounds = staticAccel->WorldBound();
+    bounds.extend(dynamicAccel->WorldBound());
+    return bounds;
+}
+
+bool SceneAccel::Intersect(const Ray &ray, SurfaceInteraction &isect) const {
+    bool hit = staticAccel->Intersect(ray, isect);
+    SurfaceInteraction dynamicIsect;
+    if (dynamicAccel->Intersect(ray, dynamicIsect) && (!hit || dynamicIsect < isect)) {
+        isect = dynamicIsect;
+        hit = true;
+    }
+    return hit;
+}
+
+bool SceneAccel::IntersectP(const Ray &ray) const {
+    return staticAccel->IntersectP(ray) || dynamicAccel->IntersectP(ray);
+}
+
+int SceneAccel::Intersect(const RayPacket &packet, SurfaceInteraction isect[RayPacket::Size]) const {
+    int hit = staticAccel->Intersect(packet, isect);
+    SurfaceInteraction dynamicIsect[RayPacket::Size];
+    int dynamicHit = dynamicAccel->Intersect(packet, dynamicIsect);
+    for (int lane = 0; lane < RayPacket::Size; lane++) {
+        if ((dynamicHit & (1 << lane)) && (!(hit & (1 << lane)) || dynamicIsect[lane] < isect[lane])) {
+            isect[lane] = dynamicIsect[lane];
+            hit |= 1 << lane;
+        }
+    }
+    return hit;
+}
+
+int SceneAccel::IntersectP(const RayPacket &packet) const {
+    int occluded = staticAccel->IntersectP(packet);
+    if (occluded == packet.active) {
+        return occluded;
+    }
+    // Only the lanes the walls did not block still need testing
+    RayPacket remaining = packet;
+    remaining.active &= ~occluded;
+    return occluded | dynamicAccel->IntersectP(remaining);
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "Aggregate.h"
+#include "Instance.h"
+
+struct SceneSnapshot;
+
+// Object, material and transform of one copy of an object the ray tracer sees
+struct ObjectPlacement {
+    ObjectTag object;
+    glm::mat4 transform;
+    // The game's own object. object.obj is a per-snapshot copy for portals
+    // and outlines, this stays the same from one snapshot to the next.
+    const GameObject *source = nullptr;
+    bool operator==(const ObjectPlacement &rhs) const {
+        return source == rhs.source && object.material == rhs.object.material && transform == rhs.transform;
+    }
+    bool operator!=(const ObjectPlacement &rhs) const { return !operator==(rhs); }
+};
+
+// Acceleration structure for one snapshot of the game scene, which it keeps
+// for the shading code. Objects are instances of shared per-mesh aggregates.
+// Walls never move, so their instances go into a static tree that is built
+// once per level and kept across frames. Everything else goes into a dynamic
+// tree that is only rebuilt when one of those objects has changed. Portals
+// are copied into every snapshot, so a kept dynamic tree is pointed at the
+// new snapshot's copies instead.
+class SceneAccel : public Aggregate {
+  public:
+    // Bring both levels up to date with scene, reusing whatever has not
+    // changed since the previous call
+    void update(std::shared_ptr<SceneSnapshot> scene, const std::string &type);
+    // Snapshot the trees were last built from. The portals are not const
+    // because they cache their directions, the snapshot fills those caches.
+    SceneSnapshot &scene() const { return *snapshot; }
+    // Changes whenever the static tree is rebuilt
+    int staticVersion() const { return staticBuilds; }
+    Bounds3f WorldBound() const;
+    bool Intersect(const Ray &ray, SurfaceInteraction &isect) const;
+    bool IntersectP(const Ray &ray) const;
+    // Packet traversal, returns a bitmask of the lanes that hit
+    int Intersect(const RayPacket &packet, SurfaceInteraction isect[RayPacket::Size]) const;
+    int IntersectP(const RayPacket &packet) const;
+
+  private:
+    std::unique_ptr<InstanceAccel> buildInstances(const std::vector<ObjectPlacement> &placements);
+
+    std::string type;
+    int staticBuilds = 0;
+    MeshCache meshes;
+    std::shared_ptr<SceneSnapshot> snapshot;
+    std::unique_ptr<InstanceAccel> staticAccel, dynamicAccel;
+    // Compared with the next snapshot to see what has to be rebuilt
+    std::vector<ObjectPlacement> staticPlacements, dynamicPlacements;
+};
@@ -0,0 +1,123 @@
+#include "SceneSnapshot.h"
+#include <algorithm>
+#include <sstream>
+#include <unordered_map>
+
+using namespace glm;
+using namespace std;
+
+std::shared_ptr<SceneSnapshot> SceneSnapshot::capture() {
+    auto scene = make_shared<SceneSnapshot>();
+    scene->eye = app.player.camera.eye;
+    scene->lookAtPoint = app.player.camera.lookAtPoint;
+    scene->upVec = app.player.camera.upVec;
+    scene->lights = app.lights;
+
+    // Copy the portals and their outlines, then point the copies at each other
+    unordered_map<const GameObject *, GameObject *> copies;
+    for (Portal &portal : app.portals) {
+        scene->portals.push_back(portal);
+        copies[&portal] = &scene->portals.back();
+    }
+    for (Portal &portal : scene->portals) {
+        if (portal.linkedPortal) {
+            portal.linkedPortal = static_cast<Portal *>(copies[portal.linkedPortal]);
+        }
+        if (portal.hasOutline) {
+            scene->outlines.push_back(*portal.outline);
+            PortalOutline &outline = scene->outlines.back();
+            copies[portal.outline] = &outline;
+            outline.parent = &portal;
+            portal.outline = &outline;
+        }
+        // Fill the direction caches now, so tracing threads only read them
+        portal.getUp();
+        portal.getForward();
+    }
+
+    // Crossing a portal only reads these, so no tracing thread builds matrices
+    for (Portal &portal : scene->portals) {
+        portal.index = scene->portalTransforms.size();
+        PortalTransform transform;
+        if (portal.linkedPortal) {
+            transform.toLinked = portal.getTransformToLinkedPortal();
+            transform.fromLinked = portal.linkedPortal->getTransformToLinkedPortal();
+        }
+        scene->portalTransforms.push_back(transform);
+    }
+
+    for (GameObject *obj : app.gameObjects) {
+        auto copy = copies.find(obj);
+        ObjectTag object(copy != copies.end() ? copy->second : obj);
+        mat4 transform = object.obj->getTransform();
+        vector<ObjectPlacement> &placements =
+            object.kind == ObjectKind::Wall ? scene->staticPlacements : scene->dynamicPlacements;
+        placements.push_back({ object, transform, obj });
+        if (object.kind == ObjectKind::Box) {
+            Box *box = static_cast<Box *>(object.obj);
+            for (Portal *portal : box->touchingPortals) {
+                placements.push_back({ object, portal->getTransformToLinkedPortal() * transform, obj });
+            }
+        }
+    }
+    return scene;
+}
+
+std::string SceneSnapshot::portalKey() const {
+    ostringstream key;
+    for (const Portal &portal : portals) {
+        key << portal.open;
+        mat4 transform = portal.getTransform();
+        for (int i = 0; i < 4; i++) {
+            for (int j = 0; j < 4; j++) {
+                key << "," << transform[i][j];
+            }
+        }
+        key << " ";
+    }
+    return key.str();
+}
+
+void SceneSnapshot::findVirtualLights(int maxDepth, float lightRadius) {
+    maxDepth = std::min(maxDepth, (int) VirtualLight::MaxDepth);
+    virtualLights.assign(lights.size(), {});
+    for (size_t i = 0; i < lights.size(); i++) {
+        VirtualLight direct;
+        direct.depth = 0;
+        addVirtualLights(virtualLights[i], direct, lights[i].position, maxDepth, lightRadius);
+    }
+}
+
+// Add the portals in front of seen, whose light appears at position
+void SceneSnapshot::addVirtualLights(std::vector<VirtualLight> &found, const VirtualLight &seen, const glm::vec3 &position,
+                                     int maxDepth, float lightRadius) {
+    if (seen.depth >= maxDepth) {
+        return;
+    }
+    for (Portal &portal : portals) {
+        Portal *linked = portal.linkedPortal;
+        if (!portal.open || !linked || !linked->open) {
+            continue;
+        }
+        // The light leaves through the linked portal, so some of its square
+        // has to be in front of it
+        if (dot(linked->getForward(), position - linked->position) <= -lightRadius) {
+            continue;
+        }
+        // Light coming out of a portal can't go back into it
+        if (seen.depth > 0 && seen.portals[0] == linked) {
+            continue;
+        }
+
+        VirtualLight light;
+        light.depth = seen.depth + 1;
+        light.portals[0] = &portal;
+        light.toVirtual[0] = portalTransform(portal).fromLinked * (seen.depth > 0 ? seen.toVirtual[0] : mat4(1));
+        for (int i = 0; i < seen.depth; i++) {
+            light.portals[i + 1] = seen.portals[i];
+            light.toVirtual[i + 1] = seen.toVirtual[i];
+        }
+        found.push_back(light);
+        addVirtualLights(found, light, vec3(portalTransform(portal).fromLinked * vec4(position, 1)), maxDepth, lightRadius);
+    }
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "Application.h"
+#include "SceneAccel.h"
+#include "LightBVH.h"
+
+// Moves points in front of a portal to the matching points in front of its
+// linked portal, and back
+struct PortalTransform {
+    glm::mat4 toLinked = glm::mat4(1), fromLinked = glm::mat4(1);
+};
+
+// A light as seen through a chain of portals. Shadow rays from a hit enter
+// portals[0] first and reach the light after leaving the linked portal of
+// portals[depth - 1].
+struct VirtualLight {
+    static const int MaxDepth = 4;
+    int depth;
+    Portal *portals[MaxDepth];
+    // toVirtual[i] moves a point on the light to where it appears from in
+    // front of portals[i]
+    glm::mat4 toVirtual[MaxDepth];
+};
+
+// Everything the ray tracer reads from the game for one frame. Portals and
+// their outlines are copied, every other object is recorded with the
+// transform it had, so the game can keep simulating while the frame is
+// traced.
+struct SceneSnapshot {
+    // Copy the current state of app
+    static std::shared_ptr<SceneSnapshot> capture();
+
+    glm::vec3 eye, lookAtPoint, upVec;
+    std::vector<Light> lights;
+    // Linked to each other, the portal and outline tags below point here
+    std::list<Portal> portals;
+    std::list<PortalOutline> outlines;
+    // Indexed by Portal::index of the copies, filled once per snapshot
+    std::vector<PortalTransform> portalTransforms;
+    // Walls never move and go into the static tree, the rest into the dynamic
+    // tree. Boxes touching a portal also show up at the other end of it.
+    std::vector<ObjectPlacement> staticPlacements, dynamicPlacements;
+
+    // Indexed like lights, filled by findVirtualLights
+    std::vector<std::vector<VirtualLight>> virtualLights;
+    // Built over the lights and virtual lights when sampling lights by
+    // importance
+    LightBVH lightTree;
+
+    const PortalTransform &portalTransform(const Portal &portal) const { return portalTransforms[portal.index]; }
+    // Open state and placement of every portal, changes whenever light
+    // through the portals can
+    std::string portalKey() const;
+    // Every chain of up to maxDepth open portals that can carry light from
+    // the lights, which are squares lightRadius wide
+    void findVirtualLights(int maxDepth, float lightRadius);
+
+  private:
+    void addVirtualLights(std::vector<VirtualLight> &found, const VirtualLight &seen, const glm::vec3 &position,
+                          int maxDepth, float lightRadius);
+};
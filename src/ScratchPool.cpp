@@ -0,0 +1,62 @@
+#include "ScratchPool.h"
+#include <algorithm>
+#include <mutex>
+
+using namespace std;
+
+void *ScratchPool::allocBytes(size_t n) {
+    // Keep every allocation 16 byte aligned
+    n = (n + 15) & ~size_t(15);
+    if (!blocks.empty() && currentOffset + n <= blocks[currentBlock].size) {
+        void *p = blocks[currentBlock].data.get() + currentOffset;
+        currentOffset += n;
+        return p;
+    }
+
+    // Move on to the next block, replacing it if it is too small. Blocks past
+    // the current one are never in use.
+    size_t next = blocks.empty() ? 0 : currentBlock + 1;
+    if (next == blocks.size() || blocks[next].size < n) {
+        Block block;
+        block.size = std::max(blockSize, n);
+        block.data.reset(new char[block.size]);
+        if (next == blocks.size()) {
+            blocks.push_back(std::move(block));
+        } else {
+            blocks[next] = std::move(block);
+        }
+    }
+    currentBlock = next;
+    currentOffset = n;
+    return blocks[next].data.get();
+}
+
+void ScratchPool::release(const Mark &m) {
+    currentBlock = m.block;
+    currentOffset = m.offset;
+}
+
+void ScratchPool::clear() {
+    blocks.clear();
+    currentBlock = currentOffset = 0;
+}
+
+// Pools returned by finished builds
+static mutex freePoolsMutex;
+static vector<unique_ptr<ScratchPool>> freePools;
+
+ScratchPool::Lease ScratchPool::acquire() {
+    lock_guard<mutex> lock(freePoolsMutex);
+    if (freePools.empty()) {
+        return Lease(new ScratchPool);
+    }
+    Lease pool(freePools.back().release());
+    freePools.pop_back();
+    return pool;
+}
+
+void ScratchPool::Recycle::operator()(ScratchPool *pool) const {
+    pool->reset();
+    lock_guard<mutex> lock(freePoolsMutex);
+    freePools.emplace_back(pool);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// Bump allocator for temporary memory used while building acceleration
+// structures. Memory is handed back in stack order by rolling back to a mark,
+// and the blocks are kept around so later allocations reuse them.
+class ScratchPool {
+public:
+    struct Mark {
+        size_t block = 0, offset = 0;
+    };
+    // Hands a pool back to the shared free list instead of freeing it
+    struct Recycle {
+        void operator()(ScratchPool *pool) const;
+    };
+    typedef std::unique_ptr<ScratchPool, Recycle> Lease;
+    // Pool from the free list, so a build reuses the blocks of earlier builds
+    // instead of allocating its own. Thread safe.
+    static Lease acquire();
+
+    explicit ScratchPool(size_t blockSize = 1 << 20) : blockSize(blockSize) {}
+    // Uninitialized storage for n trivially copyable values
+    template <typename T>
+    T *alloc(size_t n) { return static_cast<T *>(allocBytes(n * sizeof(T))); }
+    Mark mark() const { return { currentBlock, currentOffset }; }
+    void release(const Mark &m);
+    // Release everything but keep the blocks
+    void reset() { release(Mark()); }
+    // Free all blocks
+    void clear();
+
+private:
+    void *allocBytes(size_t n);
+
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+    std::vector<Block> blocks;
+    size_t blockSize, currentBlock = 0, currentOffset = 0;
+};
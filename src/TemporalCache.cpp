@@ -0,0 +1,80 @@
+#include "TemporalCache.h"
+#include "SceneSnapshot.h"
+#include <cmath>
+#include <sstream>
+
+using namespace glm;
+using namespace std;
+
+void TemporalCache::beginFrame(const PinholeCamera &camera, int width, int height, const SceneSnapshot &scene,
+                               const std::string &key, float depthTolerance, int maxAge) {
+    // Moving a light changes the indirect light everywhere
+    ostringstream fullKey;
+    fullKey << key << " " << width << "x" << height;
+    for (const Light &light : scene.lights) {
+        fullKey << " " << light.position.x << "," << light.position.y << "," << light.position.z << ","
+                << light.intensity.x << "," << light.intensity.y << "," << light.intensity.z;
+    }
+    if (fullKey.str() != this->key) {
+        hasHistory = false;
+        this->key = fullKey.str();
+    }
+    this->depthTolerance = depthTolerance;
+    this->maxAge = maxAge;
+
+    current.camera = camera;
+    current.width = width;
+    current.height = height;
+    current.indirect.assign(width * height, vec3(0));
+    current.depth.assign(width * height, INFINITY);
+    current.object.assign(width * height, nullptr);
+    current.age.assign(width * height, 0);
+    current.transforms.clear();
+    for (const ObjectPlacement &placement : scene.dynamicPlacements) {
+        // Portals are copied into every snapshot and covered by the key
+        if (placement.object.kind != ObjectKind::Portal && placement.object.kind != ObjectKind::PortalOutline) {
+            current.transforms[placement.object.obj].push_back(placement.transform);
+        }
+    }
+    // Light bounces off every object, so one moving changes the indirect
+    // light around it too, not just on itself
+    if (hasHistory && current.transforms != history.transforms) {
+        hasHistory = false;
+    }
+}
+
+bool TemporalCache::lookup(const glm::vec3 &p, const GameObject *obj, glm::vec3 &indirect, int &age) const {
+    vec2 pixel;
+    if (!hasHistory || !history.camera.project(p, pixel)) {
+        return false;
+    }
+    int x = (int) round(pixel.x), y = (int) round(pixel.y);
+    if (x < 0 || y < 0 || x >= history.width || y >= history.height) {
+        return false;
+    }
+
+    // Disoccluded pixels saw something else last frame
+    int idx = y * history.width + x;
+    if (history.object[idx] != obj || history.age[idx] >= maxAge) {
+        return false;
+    }
+    float depth = distance(history.camera.eye, p);
+    if (abs(depth - history.depth[idx]) > depthTolerance * history.depth[idx]) {
+        return false;
+    }
+    indirect = history.indirect[idx];
+    age = history.age[idx];
+    return true;
+}
+
+void TemporalCache::record(int pixelIdx, const GameObject *obj, float depth, const glm::vec3 &indirect, int age) {
+    current.object[pixelIdx] = obj;
+    current.depth[pixelIdx] = depth;
+    current.indirect[pixelIdx] = indirect;
+    current.age[pixelIdx] = age;
+}
+
+void TemporalCache::endFrame() {
+    std::swap(history, current);
+    hasHistory = true;
+}
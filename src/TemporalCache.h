@@ -0,0 +1,50 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <glm/glm.hpp>
+#include "PinholeCamera.h"
+#include "SceneAccel.h"
+
+struct SceneSnapshot;
+
+// Indirect light of the previous frame's camera hits, reprojected into the
+// next frame so pixels that still see the same surface can skip their bounce
+// rays. A pixel's history is used if the same object is at the same depth
+// where it lands in the old frame and the value is younger than maxAge
+// frames. Everything is dropped when any object moves or the walls, the
+// lights, the portals or the settings change.
+class TemporalCache {
+  public:
+    // Start tracing a frame. key should describe the settings the indirect
+    // light depends on.
+    void beginFrame(const PinholeCamera &camera, int width, int height, const SceneSnapshot &scene,
+                    const std::string &key, float depthTolerance, int maxAge);
+    // Indirect light of the previous frame at p on obj, and how many frames
+    // it has been reused for
+    bool lookup(const glm::vec3 &p, const GameObject *obj, glm::vec3 &indirect, int &age) const;
+    // Indirect light of pixelIdx this frame, seen at depth on obj
+    void record(int pixelIdx, const GameObject *obj, float depth, const glm::vec3 &indirect, int age);
+    // The recorded frame becomes the history of the next one
+    void endFrame();
+
+  private:
+    struct Frame {
+        PinholeCamera camera;
+        int width = 0, height = 0;
+        std::vector<glm::vec3> indirect;
+        std::vector<float> depth;
+        // Object seen by each pixel, null where nothing can be reused
+        std::vector<const GameObject *> object;
+        std::vector<int> age;
+        // Transforms of the objects that can move, other than portals
+        std::unordered_map<const GameObject *, std::vector<glm::mat4>> transforms;
+    };
+
+    Frame history, current;
+    bool hasHistory = false;
+    std::string key;
+    float depthTolerance = 0;
+    int maxAge = 0;
+};
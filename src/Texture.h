@@ -18,6 +18,7 @@ public:
 	void unbind();
 	void setWrapModes(GLint wrapS, GLint wrapT); // Must be called after init()
 	GLint getID() const { return tid;}
+	int getComponents() const { return ncomps; }
 	int width;
 	int height;
 	unsigned char *data;
@@ -0,0 +1,108 @@
+#include "TileScheduler.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using namespace std;
+
+// Interleave the bits of x and y
+static uint32_t mortonCode(uint32_t x, uint32_t y) {
+    uint32_t code = 0;
+    for (int i = 0; i < 16; i++) {
+        code |= ((x >> i) & 1) << (2 * i);
+        code |= ((y >> i) & 1) << (2 * i + 1);
+    }
+    return code;
+}
+
+TileScheduler::TileScheduler(int width, int height, int tileSize) {
+    int tilesX = (width + tileSize - 1) / tileSize;
+    int tilesY = (height + tileSize - 1) / tileSize;
+    vector<pair<uint32_t, Tile>> ordered;
+    ordered.reserve(tilesX * tilesY);
+    for (int ty = 0; ty < tilesY; ty++) {
+        for (int tx = 0; tx < tilesX; tx++) {
+            Tile tile = { tx * tileSize, ty * tileSize,
+                          std::min(width, (tx + 1) * tileSize), std::min(height, (ty + 1) * tileSize) };
+            ordered.push_back({ mortonCode(tx, ty), tile });
+        }
+    }
+    stable_sort(ordered.begin(), ordered.end(),
+                [](const pair<uint32_t, Tile> &a, const pair<uint32_t, Tile> &b) { return a.first < b.first; });
+    for (const auto &entry : ordered) {
+        tiles.push_back(entry.second);
+    }
+}
+
+bool TileScheduler::pop(WorkQueue &queue, int &tile) {
+    lock_guard<mutex> lock(queue.mutex);
+    if (queue.tiles.empty()) {
+        return false;
+    }
+    tile = queue.tiles.front();
+    queue.tiles.pop_front();
+    return true;
+}
+
+bool TileScheduler::steal(WorkQueue &queue, int &tile) {
+    // Take from the back, away from where the owner is working
+    lock_guard<mutex> lock(queue.mutex);
+    if (queue.tiles.empty()) {
+        return false;
+    }
+    tile = queue.tiles.back();
+    queue.tiles.pop_back();
+    return true;
+}
+
+void TileScheduler::run(const std::function<void(const Tile &)> &renderTile, const Progress &progress) {
+#ifdef _OPENMP
+    int numThreads = omp_get_max_threads();
+#else
+    int numThreads = 1;
+#endif
+
+    // Give every thread a contiguous stretch of the Morton curve
+    queues.clear();
+    for (int t = 0; t < numThreads; t++) {
+        queues.push_back(make_unique<WorkQueue>());
+        int begin = (int) ((int64_t) tiles.size() * t / numThreads);
+        int end = (int) ((int64_t) tiles.size() * (t + 1) / numThreads);
+        for (int i = begin; i < end; i++) {
+            queues[t]->tiles.push_back(i);
+        }
+    }
+
+    atomic<int> done(0);
+    mutex progressMutex;
+    #pragma omp parallel num_threads(numThreads)
+    {
+#ifdef _OPENMP
+        int self = omp_get_thread_num();
+#else
+        int self = 0;
+#endif
+        while (true) {
+            int tile;
+            bool found = pop(*queues[self], tile);
+            // No tiles are added while rendering, so once every queue is
+            // empty this thread is done
+            for (int i = 1; i < numThreads && !found; i++) {
+                found = steal(*queues[(self + i) % numThreads], tile);
+            }
+            if (!found) {
+                break;
+            }
+
+            renderTile(tiles[tile]);
+            int finished = ++done;
+            if (progress) {
+                lock_guard<mutex> lock(progressMutex);
+                progress(finished, numTiles());
+            }
+        }
+    }
+}
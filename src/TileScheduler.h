@@ -0,0 +1,39 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Rectangle of pixels rendered as one unit of work, [x0, x1) x [y0, y1)
+struct Tile {
+    int x0, y0, x1, y1;
+};
+
+// Splits an image into small tiles and renders them on all threads. Tiles are
+// numbered along a Morton curve so neighbouring tiles, which hit the same
+// geometry, are close together in every thread's queue. Each thread starts
+// with its own stretch of the curve and steals from the far end of another
+// thread's queue once it runs dry, so expensive regions such as portal views
+// do not hold up the rest of the frame.
+class TileScheduler {
+  public:
+    // Called after every finished tile with the number of finished tiles
+    typedef std::function<void(int done, int total)> Progress;
+
+    TileScheduler(int width, int height, int tileSize = 16);
+    int numTiles() const { return (int) tiles.size(); }
+    void run(const std::function<void(const Tile &)> &renderTile, const Progress &progress = nullptr);
+
+  private:
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<int> tiles;
+    };
+    bool pop(WorkQueue &queue, int &tile);
+    bool steal(WorkQueue &queue, int &tile);
+
+    std::vector<Tile> tiles;
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+};
@@ -0,0 +1,324 @@
+#include "WavefrontIntegrator.h"
+#include "RTShading.h"
+#include <algorithm>
+
+using namespace glm;
+using namespace std;
+
+// Camera, bounce and portal continuation rays, shaded when they hit
+struct PathRay {
+    Ray ray;
+    Sampler sampler;
+    glm::vec3 weight;
+    int pixel;
+    int bounceDepth;
+    // Portals passed through since the last bounce
+    int portalHops = 0;
+};
+
+// Shadow ray that adds contribution to its pixel if nothing blocks it
+struct ShadowRay {
+    Ray ray;
+    glm::vec3 contribution;
+    int pixel;
+};
+
+// Shadow ray towards a light seen through portals. If it reaches the portal
+// of its leg it continues from the linked portal, after the last leg as a
+// ShadowRay.
+struct PortalShadowRay {
+    Ray ray;
+    const VirtualLight *virtualLight;
+    int leg;
+    glm::vec3 lightPos;
+    glm::vec3 contribution;
+    int pixel;
+};
+
+struct WavefrontQueues {
+    std::vector<PathRay> paths, nextPaths;
+    std::vector<ShadowRay> shadowRays;
+    std::vector<PortalShadowRay> portalShadowRays, nextPortalShadowRays;
+};
+
+// Spread the lowest 10 bits of x out to every third bit
+static uint32_t leftShift3(uint32_t x) {
+    x &= 0x3ff;
+    x = (x | (x << 16)) & 0x30000ff;
+    x = (x | (x << 8)) & 0x300f00f;
+    x = (x | (x << 4)) & 0x30c30c3;
+    x = (x | (x << 2)) & 0x9249249;
+    return x;
+}
+
+static uint32_t mortonCode3(const glm::vec3 &p, float scale) {
+    uvec3 q = uvec3(clamp(p, vec3(0), vec3(1)) * scale);
+    return (leftShift3(q.z) << 2) | (leftShift3(q.y) << 1) | leftShift3(q.x);
+}
+
+// Rays are grouped by direction octant, then by origin and finally by
+// direction within the octant
+static uint64_t raySortKey(const Ray &ray, const Bounds3f &bounds) {
+    uint64_t octant = (ray.d.x < 0) | ((ray.d.y < 0) << 1) | ((ray.d.z < 0) << 2);
+    uint64_t origin = mortonCode3(bounds.Offset(ray.o), 1023);
+    uint64_t direction = mortonCode3(abs(ray.d), 127);
+    return (octant << 51) | (origin << 21) | direction;
+}
+
+template <typename T>
+static void sortQueue(std::vector<T> &queue, const Bounds3f &bounds) {
+    vector<pair<uint64_t, int>> keys;
+    keys.reserve(queue.size());
+    for (size_t i = 0; i < queue.size(); i++) {
+        keys.push_back({ raySortKey(queue[i].ray, bounds), (int) i });
+    }
+    sort(keys.begin(), keys.end());
+    vector<T> sorted;
+    sorted.reserve(queue.size());
+    for (const auto &key : keys) {
+        sorted.push_back(queue[key.second]);
+    }
+    queue.swap(sorted);
+}
+
+// Turn a path's hit into shadow rays, new paths and light added to its pixel
+// Queue a shadow ray towards samplePos
+static void queueShadowRay(const PathRay &path, const glm::vec3 &hitPos, const glm::vec3 &hitNorm, const glm::vec3 &samplePos,
+                           const Material *material, const glm::vec3 &texColor, const glm::vec3 &intensity,
+                           const glm::vec3 &weight, WavefrontQueues &queues) {
+    vec3 lightDir = normalize(samplePos - hitPos);
+    ShadowRay shadowRay;
+    shadowRay.ray = Ray(hitPos, lightDir, distance(samplePos, hitPos));
+    shadowRay.contribution = weight * blinnPhong(material, texColor, hitNorm, lightDir, path.ray.d, intensity);
+    shadowRay.pixel = path.pixel;
+    queues.shadowRays.push_back(shadowRay);
+}
+
+// Queue the first leg of a shadow ray towards samplePos seen through
+// virtualLight, the first leg has to reach the portal
+static void queuePortalShadowRay(const PathRay &path, const glm::vec3 &hitPos, const glm::vec3 &hitNorm,
+                                 const glm::vec3 &samplePos, const VirtualLight &virtualLight, const Material *material,
+                                 const glm::vec3 &texColor, const glm::vec3 &intensity, const glm::vec3 &weight,
+                                 WavefrontQueues &queues) {
+    Portal &portal = *virtualLight.portals[0];
+    if (!portal.facing(hitPos) || !virtualLight.portals[virtualLight.depth - 1]->linkedPortal->facing(samplePos)) {
+        return;
+    }
+    vec3 transformedLightPos = vec3(virtualLight.toVirtual[0] * vec4(samplePos, 1));
+    vec3 portalLightDir = normalize(transformedLightPos - hitPos);
+    if (!fastCheckPortal(hitPos, portalLightDir, portal)) {
+        return;
+    }
+    PortalShadowRay portalRay;
+    portalRay.ray = Ray(hitPos, portalLightDir);
+    portalRay.virtualLight = &virtualLight;
+    portalRay.leg = 0;
+    portalRay.lightPos = samplePos;
+    portalRay.contribution = weight * blinnPhong(material, texColor, hitNorm, portalLightDir, path.ray.d, intensity);
+    portalRay.pixel = path.pixel;
+    queues.portalShadowRays.push_back(portalRay);
+}
+
+static void shadePathHit(const PathRay &path, const SurfaceInteraction &hit, SceneSnapshot &scene,
+                         WavefrontQueues &queues, std::vector<glm::vec3> &radiance) {
+    const Ray &ray = path.ray;
+    vec3 vert[3] = { hit.vert(0), hit.vert(1), hit.vert(2) };
+    vec3 hitPos = hit.u * vert[1] + hit.v * vert[2] + (1 - hit.u - hit.v) * vert[0];
+    vec3 hitNorm = hit.normal();
+
+    Material *material = hit.material;
+    if (material) {
+        Sampler sampler = path.sampler;
+        vec3 texColor = surfaceTexColor(ray, hit);
+        vector<vec3> samplePositions;
+        float sampleWeight = lightSampleWeight(path.bounceDepth);
+        if (useLightTree) {
+            // Every shadow ray picks its own light
+            int numSamples = softShadows(path.bounceDepth) ? numShadowSamplesX * numShadowSamplesY : 1;
+            SampleSet pickSet = sampler.startSet();
+            SampleSet lightSet = sampler.startSet();
+            for (int i = 0; i < numSamples; i++) {
+                LightTreeSample sample;
+                if (!sampleLightTree(scene, hitPos, hitNorm, pickSet[i].x, lightSet[i], path.bounceDepth, sample)) {
+                    continue;
+                }
+                const Light &light = scene.lights[sample.emitter->light];
+                vec3 weight = path.weight * sampleWeight * sample.weight;
+                if (!sample.emitter->virtualLight) {
+                    queueShadowRay(path, hitPos, hitNorm, sample.position, material, texColor, light.intensity, weight, queues);
+                }
+                else {
+                    queuePortalShadowRay(path, hitPos, hitNorm, sample.position, *sample.emitter->virtualLight, material,
+                                         texColor, light.intensity, weight, queues);
+                }
+            }
+        }
+        else {
+            for (size_t lightNum = 0; lightNum < scene.lights.size(); lightNum++) {
+                const Light &light = scene.lights[lightNum];
+                lightSamplePositions(light, hitPos, sampler, path.bounceDepth, samplePositions);
+                for (const vec3 &samplePos : samplePositions) {
+                    vec3 weight = path.weight * sampleWeight;
+                    queueShadowRay(path, hitPos, hitNorm, samplePos, material, texColor, light.intensity, weight, queues);
+                    // Light through portals
+                    for (const VirtualLight &virtualLight : scene.virtualLights[lightNum]) {
+                        queuePortalShadowRay(path, hitPos, hitNorm, samplePos, virtualLight, material, texColor,
+                                             light.intensity, weight, queues);
+                    }
+                }
+            }
+        }
+
+        if (path.bounceDepth < numBounces) {
+            SampleSet bounceSet = sampler.startSet();
+            vec3 bounceWeight = path.weight * texColor / 255.f / (float) numBounceRays;
+            for (int i = 0; i < bounceRayCount(path.bounceDepth); i++) {
+                Ray bounceRay(hitPos, sampleHemisphere(hitNorm, bounceSet[i]));
+                queues.nextPaths.push_back({ bounceRay, sampler.split(), bounceWeight, path.pixel, path.bounceDepth + 1 });
+            }
+        }
+    }
+    else if (hit.kind == ObjectKind::Portal) {
+        Portal *portal = static_cast<Portal *>(hit.obj);
+        if (!portal->open || !portal->linkedPortal->open) {
+            if (portal->hasOutline) {
+                radiance[path.pixel] += path.weight * portal->outline->color * 255.f;
+            }
+            return;
+        }
+
+        // Facing portals would otherwise keep the path going forever
+        if (path.portalHops >= maxPortalHops) {
+            return;
+        }
+
+        // Continue the same path on the other side
+        const mat4 &toLinked = scene.portalTransform(*portal).toLinked;
+        vec3 newEye = vec3(toLinked * vec4(ray.o, 1));
+        vec3 newOrig = vec3(toLinked * vec4(hitPos, 1));
+        PathRay continuation = path;
+        continuation.portalHops++;
+        continuation.ray = Ray(newOrig, normalize(newOrig - newEye));
+        portalDifferentials(ray, hitPos, hitNorm, toLinked, continuation.ray);
+        queues.nextPaths.push_back(continuation);
+    }
+    else if (hit.kind == ObjectKind::PortalOutline) {
+        radiance[path.pixel] += path.weight * static_cast<PortalOutline *>(hit.obj)->color * 255.f;
+    }
+    else {
+        radiance[path.pixel] += path.weight * 255.f;
+    }
+}
+
+// Trace the closest hits of a queue, RayPacket::Size rays at a time
+template <typename T>
+static void intersectQueue(const std::vector<T> &queue, const Aggregate &accel,
+                           std::vector<SurfaceInteraction> &hits, std::vector<bool> &hitFlags) {
+    hits.resize(queue.size());
+    hitFlags.assign(queue.size(), false);
+    for (size_t i = 0; i < queue.size(); i += RayPacket::Size) {
+        int count = std::min((int) (queue.size() - i), RayPacket::Size);
+        Ray rays[RayPacket::Size];
+        for (int lane = 0; lane < count; lane++) {
+            rays[lane] = queue[i + lane].ray;
+        }
+        SurfaceInteraction packetHits[RayPacket::Size];
+        int hitMask = accel.Intersect(RayPacket(rays, count), packetHits);
+        for (int lane = 0; lane < count; lane++) {
+            if (hitMask & (1 << lane)) {
+                hits[i + lane] = packetHits[lane];
+                hitFlags[i + lane] = true;
+            }
+        }
+    }
+}
+
+// Render the paths of one tile, radiance is indexed by PathRay::pixel
+static void traceWavefront(WavefrontQueues &queues, const SceneAccel &accel, std::vector<glm::vec3> &radiance) {
+    Bounds3f bounds = accel.WorldBound();
+    vector<SurfaceInteraction> hits;
+    vector<bool> hitFlags;
+    while (!queues.paths.empty()) {
+        // Closest hits of the current paths, shading queues the next stages
+        sortQueue(queues.paths, bounds);
+        intersectQueue(queues.paths, accel, hits, hitFlags);
+        for (size_t i = 0; i < queues.paths.size(); i++) {
+            if (hitFlags[i]) {
+                shadePathHit(queues.paths[i], hits[i], accel.scene(), queues, radiance);
+            }
+        }
+
+        // Legs of the shadow rays through portals, one portal per round
+        while (!queues.portalShadowRays.empty()) {
+            sortQueue(queues.portalShadowRays, bounds);
+            intersectQueue(queues.portalShadowRays, accel, hits, hitFlags);
+            for (size_t i = 0; i < queues.portalShadowRays.size(); i++) {
+                const PortalShadowRay &portalRay = queues.portalShadowRays[i];
+                const VirtualLight &virtualLight = *portalRay.virtualLight;
+                Portal *portal = virtualLight.portals[portalRay.leg];
+                if (!hitFlags[i] || hits[i].obj != portal) {
+                    continue;
+                }
+                const SurfaceInteraction &hit = hits[i];
+                vec3 portalHitPos = hit.u * hit.vert(1) + hit.v * hit.vert(2) + (1 - hit.u - hit.v) * hit.vert(0);
+                vec3 shadowOrig = vec3(accel.scene().portalTransform(*portal).toLinked * vec4(portalHitPos, 1));
+                if (portalRay.leg + 1 < virtualLight.depth) {
+                    vec3 target = vec3(virtualLight.toVirtual[portalRay.leg + 1] * vec4(portalRay.lightPos, 1));
+                    vec3 dir = normalize(target - shadowOrig);
+                    if (fastCheckPortal(shadowOrig, dir, *virtualLight.portals[portalRay.leg + 1])) {
+                        PortalShadowRay next = portalRay;
+                        next.ray = Ray(shadowOrig, dir);
+                        next.leg++;
+                        queues.nextPortalShadowRays.push_back(next);
+                    }
+                    continue;
+                }
+                ShadowRay shadowRay;
+                shadowRay.ray = Ray(shadowOrig, normalize(portalRay.lightPos - shadowOrig),
+                                    distance(portalRay.lightPos, shadowOrig));
+                shadowRay.contribution = portalRay.contribution;
+                shadowRay.pixel = portalRay.pixel;
+                queues.shadowRays.push_back(shadowRay);
+            }
+            queues.portalShadowRays.swap(queues.nextPortalShadowRays);
+            queues.nextPortalShadowRays.clear();
+        }
+
+        // Shadow rays
+        sortQueue(queues.shadowRays, bounds);
+        for (size_t i = 0; i < queues.shadowRays.size(); i += RayPacket::Size) {
+            int count = std::min((int) (queues.shadowRays.size() - i), RayPacket::Size);
+            Ray rays[RayPacket::Size];
+            for (int lane = 0; lane < count; lane++) {
+                rays[lane] = queues.shadowRays[i + lane].ray;
+            }
+            int occluded = accel.IntersectP(RayPacket(rays, count));
+            for (int lane = 0; lane < count; lane++) {
+                if (!(occluded & (1 << lane))) {
+                    const ShadowRay &shadowRay = queues.shadowRays[i + lane];
+                    radiance[shadowRay.pixel] += shadowRay.contribution;
+                }
+            }
+        }
+        queues.shadowRays.clear();
+
+        queues.paths.swap(queues.nextPaths);
+        queues.nextPaths.clear();
+    }
+}
+
+void traceWavefrontTile(const Tile &tile, const PinholeCamera &camera, int width, const SceneAccel &accel,
+                        std::vector<glm::vec3> &radiance) {
+    int tileWidth = tile.x1 - tile.x0;
+    WavefrontQueues queues;
+    radiance.assign((tile.y1 - tile.y0) * tileWidth, vec3(0));
+    for (int py = tile.y0; py < tile.y1; py++) {
+        for (int px = tile.x0; px < tile.x1; px++) {
+            // Seeded per pixel so the result does not depend on the thread
+            Sampler sampler(sampleSequence, sampleSeed, py * width + px);
+            int local = (py - tile.y0) * tileWidth + (px - tile.x0);
+            queues.paths.push_back({ camera.generateRay(px, py), sampler, vec3(1), local, 0 });
+        }
+    }
+    traceWavefront(queues, accel, radiance);
+}
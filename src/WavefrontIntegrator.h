@@ -0,0 +1,18 @@
+#pragma once
+
+#include <vector>
+#include <glm/glm.hpp>
+#include "PinholeCamera.h"
+#include "SceneAccel.h"
+#include "TileScheduler.h"
+
+// Wavefront integrator. Instead of following every ray depth first, the rays
+// of a tile wait in queues per stage and each queue is sorted by direction and
+// origin and traced in one go, so packets are coherent and the accelerator
+// stays in cache. Paths never split into recursive calls, the weight of a
+// path into its pixel is carried along with the ray instead.
+
+// Render the pixels of tile, radiance is indexed by the pixel's position in
+// the tile
+void traceWavefrontTile(const Tile &tile, const PinholeCamera &camera, int width, const SceneAccel &accel,
+                        std::vector<glm::vec3> &radiance);
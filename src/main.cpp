@@ -19,7 +19,7 @@ int main(int argc, char *argv[]) {
         "\t-l: open level (default: level1.txt)\n"
         "\t-r: record input to file\n" \
         "\t-p: playback input from file\n" \
-        "\t-t: render frames with raytracing";
+        "\t-t: play back input from file and ray trace every frame, without a window";
 
     int opt;
     while ((opt = getopt(argc, argv, "l:r:p:t:")) != -1) {